@@ -0,0 +1,102 @@
+#include "mmio.h"
+
+//----------------------------------------------------------------------------------------------------
+// Peripheral Models
+//----------------------------------------------------------------------------------------------------
+uint32_t MmioUart::read(uint32_t offs) {
+    if (offs < 4) return clkdiv;
+    if (received < input.size()) return (uint8_t) input[received++];
+    return ~0u;
+}
+
+void MmioUart::write(uint32_t offs, uint32_t data, uint32_t wstrb) {
+    if (offs < 4)
+        clkdiv = mmio_merge(clkdiv, data, wstrb);
+    else if (wstrb & 1)
+        output.push_back((char) (data & 0xFF));
+}
+
+void MmioUart::reset() {
+    output.clear();
+    clkdiv = 0;
+    received = 0;
+}
+
+void MmioLeds::write(uint32_t offs, uint32_t data, uint32_t wstrb) {
+    (void) offs;
+    value = mmio_merge(value, data, wstrb);
+    writes++;
+}
+
+//----------------------------------------------------------------------------------------------------
+// Address Decoder
+//----------------------------------------------------------------------------------------------------
+MmioBus::MmioBus() {
+    m_dev.push_back(&leds);
+    m_dev.push_back(&uart);
+}
+
+MmioPeripheral* MmioBus::find(uint32_t addr) const {
+    for (MmioPeripheral* p : m_dev)
+        if (p->fast && p->contains(addr)) return p;
+    return NULL;
+}
+
+bool MmioBus::read(uint32_t addr, uint32_t& data) {
+    MmioPeripheral* p = find(addr);
+    if (!p) return false;
+    data = p->read(addr - p->base());
+    return true;
+}
+
+bool MmioBus::write(uint32_t addr, uint32_t data, uint32_t wstrb) {
+    MmioPeripheral* p = find(addr);
+    if (!p) return false;
+    p->write(addr - p->base(), data, wstrb);
+    return true;
+}
+
+bool MmioBus::configure(const std::string& list) {
+    std::string l = list + ",";
+    for (size_t a = 0, b; (b = l.find(',', a)) != std::string::npos; a = b + 1) {
+        std::string item = l.substr(a, b - a);
+        size_t eq = item.find('=');
+        if (item.empty()) continue;
+        if (eq == std::string::npos) return false;
+        std::string name = item.substr(0, eq), mode = item.substr(eq + 1);
+        MmioPeripheral* dev = NULL;
+        for (MmioPeripheral* p : m_dev)
+            if (p->name() == name) dev = p;
+        if (!dev || (mode != "fast" && mode != "rtl")) return false;
+        dev->fast = mode == "fast";
+    }
+    return true;
+}
+
+void MmioBus::reset() {
+    for (MmioPeripheral* p : m_dev) p->reset();
+    busy = false;
+}
+
+//----------------------------------------------------------------------------------------------------
+// DPI Hooks
+//----------------------------------------------------------------------------------------------------
+static thread_local MmioBus* mmio_current = NULL;
+
+void mmio_bind(MmioBus* bus) {
+    mmio_current = bus;
+}
+
+int mmio_fast(int addr) {
+    return mmio_current && mmio_current->find((uint32_t) addr) != NULL;
+}
+
+int mmio_read(int addr) {
+    uint32_t data = ~0u;
+    if (mmio_current) mmio_current->read((uint32_t) addr, data);
+    return (int) data;
+}
+
+void mmio_write(int addr, int data, int wstrb) {
+    if (mmio_current) mmio_current->write((uint32_t) addr, (uint32_t) data, (uint32_t) wstrb);
+}
@@ -0,0 +1,107 @@
+#ifndef MMIO_H
+#define MMIO_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------------------------------
+// Memory-Mapped Peripherals
+//----------------------------------------------------------------------------------------------------
+// C++ models of the SoC peripherals seen by the firmware (fw/src/firmware.c). They answer the bus
+// with zero wait states, so a boot log printed through the UART costs a store per character instead
+// of the RTL's bit-serial frames. Each peripheral is either fast (served here) or rtl (left to the
+// RTL, e.g. for the windows whose power has to be accurate).
+class MmioPeripheral {
+  public:
+    MmioPeripheral(const char* name, uint32_t base, uint32_t size)
+        : m_name(name), m_base(base), m_size(size) {}
+    virtual ~MmioPeripheral() {}
+    // Register at offs from the base; wstrb has one bit per byte lane
+    virtual uint32_t read(uint32_t offs) = 0;
+    virtual void write(uint32_t offs, uint32_t data, uint32_t wstrb) = 0;
+    // State of a new run
+    virtual void reset() {}
+    bool contains(uint32_t addr) const { return addr - m_base < m_size; }
+    const std::string& name() const { return m_name; }
+    uint32_t base() const { return m_base; }
+    bool fast = true;                   // false: the RTL serves it
+  private:
+    std::string m_name;
+    uint32_t m_base;
+    uint32_t m_size;
+};
+
+// Byte lanes of wstrb applied to a register
+static inline uint32_t mmio_merge(uint32_t old, uint32_t data, uint32_t wstrb) {
+    uint32_t mask = 0;
+    for (int i = 0; i < 4; i++)
+        if (wstrb & (1u << i)) mask |= 0xFFu << (8 * i);
+    return (old & ~mask) | (data & mask);
+}
+
+// PicoSoC simpleuart: clock divider (reg_uart_clkdiv, 0x02000004) and data (reg_uart_data,
+// 0x02000008). Written characters go to the host buffer; a read of the data register returns the
+// next input character, or ~0 when there is none, as the RTL does with an empty receiver.
+class MmioUart : public MmioPeripheral {
+  public:
+    MmioUart(uint32_t base = 0x02000004) : MmioPeripheral("uart", base, 8) {}
+    uint32_t read(uint32_t offs) override;
+    void write(uint32_t offs, uint32_t data, uint32_t wstrb) override;
+    void reset() override;
+    std::string output;                 // what the firmware printed in this run
+    std::string input;                  // characters for the firmware to read, in order
+    size_t   received = 0;              // of them, read so far
+    uint32_t clkdiv   = 0;
+};
+
+// LED register (reg_leds, 0x02000000)
+class MmioLeds : public MmioPeripheral {
+  public:
+    MmioLeds(uint32_t base = 0x02000000) : MmioPeripheral("leds", base, 4) {}
+    uint32_t read(uint32_t offs) override { (void) offs; return value; }
+    void write(uint32_t offs, uint32_t data, uint32_t wstrb) override;
+    void reset() override { value = 0; writes = 0; }
+    uint32_t value  = 0;
+    uint64_t writes = 0;
+};
+
+// Address decoder over the peripherals of one simulation: each worker has its own
+class MmioBus {
+  public:
+    MmioBus();
+    MmioBus(const MmioBus&) = delete;
+    MmioBus& operator=(const MmioBus&) = delete;
+    // Fast peripheral at addr, NULL if the address belongs to the RTL
+    MmioPeripheral* find(uint32_t addr) const;
+    // false if no fast peripheral serves addr
+    bool read(uint32_t addr, uint32_t& data);
+    bool write(uint32_t addr, uint32_t data, uint32_t wstrb);
+    // "uart=fast,leds=rtl": switch peripherals between the models and the RTL; false if unknown
+    bool configure(const std::string& list);
+    void reset();
+    MmioUart uart;
+    MmioLeds leds;
+    bool busy = false;                  // port hook: ready raised, waiting for the clock edge
+  private:
+    std::vector<MmioPeripheral*> m_dev;
+};
+
+//----------------------------------------------------------------------------------------------------
+// DPI Hooks
+//----------------------------------------------------------------------------------------------------
+// For RTL bus decoders that call the models instead of exposing the bus on the top ports:
+//     import "DPI-C" function int  mmio_fast(input int addr);
+//     import "DPI-C" function int  mmio_read(input int addr);
+//     import "DPI-C" function void mmio_write(input int addr, input int data, input int wstrb);
+// They use the bus bound to the calling thread, the one that runs eval(); a thread without a bus
+// leaves every address to the RTL (mmio_fast() returns 0).
+void mmio_bind(MmioBus* bus);
+
+extern "C" {
+    int  mmio_fast(int addr);
+    int  mmio_read(int addr);
+    void mmio_write(int addr, int data, int wstrb);
+}
+
+#endif // MMIO_H
@@ -1,10 +1,32 @@
 #include "sim_utils.h"
 #include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../../traces/src/trs.h"       // Trace-set container shared with readvcd
+#if defined(SIM_PROFILE)
+    #include <chrono>
+    #include <sys/resource.h>
+#endif
 
 //----------------------------------------------------------------------------------------------------
-// Global Simulation Time Definition
+// Simulation Context
 //----------------------------------------------------------------------------------------------------
-vluint64_t sim_time = 0;
+void sim_reset(SimContext& sim) {
+    sim.sim_time        = 0;
+    // Update interval: every 1% of the total simulation time.
+    sim.next_update     = 2 * HALF_CYCLE * MAX_SIM_TIME / 100;
+    sim.progress_active = true;
+    sim.trigger_cycle   = sim.trigger_armed ? -1 : 0;
+    sim.window          = 0;
+    if (sim.mmio)
+        sim.mmio->reset();
+    #if defined(SIM_PROFILE)
+        sim.profile     = SimProfile();
+    #endif
+}
 
 //------------------------------------------------------------------------------
 // Clears the progress bar line using ANSI escape codes.
@@ -19,24 +41,20 @@ void clear_progress_bar() {
 // update_progress_bar()
 //    Computes and displays an interactive progress bar on the same console line.
 //------------------------------------------------------------------------------
-void update_progress_bar() {
+void update_progress_bar(SimContext& sim) {
     // Total simulation time (same units as sim_time)
     const vluint64_t TOTAL_SIM = 2 * HALF_CYCLE * MAX_SIM_TIME;
     // Update interval: every 1% of TOTAL_SIM.
     const vluint64_t UPDATE_INTERVAL = TOTAL_SIM / 100;
-    
-    // Static variable to hold the next simulation time at which to update.
-    static vluint64_t next_update = UPDATE_INTERVAL;
-    // Static flag so that after finishing we don't update anymore.
-    static bool progressActive = true;
 
+    // The next threshold and the finished flag live in the context (see sim_reset).
     // If the progress bar is done, do nothing.
-    if (!progressActive)
+    if (!sim.progress_active)
         return;
     
     // When the simulation time has reached (or passed) the next threshold:
-    if (sim_time >= next_update) {
-        double progress = (double)sim_time * 100.0 / TOTAL_SIM;
+    if (sim.sim_time >= sim.next_update) {
+        double progress = (double)sim.sim_time * 100.0 / TOTAL_SIM;
         const int barWidth = 50; 
         int pos = (int)(progress / 100.0 * barWidth);
 
@@ -44,7 +62,7 @@ void update_progress_bar() {
         if (progress >= 100.0) {
             // Clear the progress line and move to a new line.
             clear_progress_bar();
-            progressActive = false;  // Disable further progress updates.
+            sim.progress_active = false;  // Disable further progress updates.
             // (Optionally, you could print a final message here.)
             return;
         }
@@ -63,7 +81,7 @@ void update_progress_bar() {
         fflush(stdout);
 
         // Set the next update threshold.
-        next_update += UPDATE_INTERVAL;
+        sim.next_update += UPDATE_INTERVAL;
     }
 }
 
@@ -96,14 +114,14 @@ int getch(void) {
 // Verilog-like $display function.
 // The boolean argument determines whether to print the simulation time.
 //----------------------------------------------------------------------------------------------------
-void verilog_display(bool prepend_time, const char* format, ...) {
+void verilog_display(const SimContext& sim, bool prepend_time, const char* format, ...) {
     // Clear the progress bar before printing a new message.
     clear_progress_bar();
     
     va_list args;
     va_start(args, format);
     if (prepend_time) {
-        printf("[t = %lu ns] ", sim_time / (2*HALF_CYCLE));
+        printf("[t = %lu ns] ", sim.sim_time / (2*HALF_CYCLE));
     }
     vprintf(format, args);
     printf("\n");
@@ -116,66 +134,111 @@ void verilog_display(bool prepend_time, const char* format, ...) {
 // A simple monitor function that checks if a signal's current value differs
 // from the stored value. If so, it prints the change and updates the stored value.
 // The 'format' string is used to print the value—for example, you can pass "out = %x".
-void verilog_monitor(const char* format, int current_value, int* last_value) {
+void verilog_monitor(const SimContext& sim, const char* format, int current_value, int* last_value) {
     if (current_value != *last_value) {
-        verilog_display(true, format, current_value);
+        verilog_display(sim, true, format, current_value);
         *last_value = current_value;
     }
 }
 // Define the variables to monitorize
 // int monitor_leds = 0;
 
+//----------------------------------------------------------------------------------------------------
+// Fast peripherals on the bus ports of the top module (MMIO_PORTS in the Makefile)
+//----------------------------------------------------------------------------------------------------
+// PicoSoC iomem-style handshake: the CPU holds valid (with addr, wdata, wstrb; wstrb == 0 reads)
+// until ready. An access to a fast peripheral is served right after the rising edge that raised
+// valid, so ready is seen at the next rising edge: no wait state. Other addresses are left to
+// the RTL, which must answer them itself.
+#if defined(MMIO_BUS)
+static void mmio_service(SimContext& sim) {
+    Vsim*    dut = sim.dut;
+    MmioBus* bus = sim.mmio;
+    if (!bus || !dut->CLOCK_SIGNAL)
+        return;
+    // The access completed at this edge
+    if (bus->busy) {
+        dut->MMIO_READY = 0;
+        bus->busy = false;
+    }
+    if (dut->MMIO_VALID && bus->find(dut->MMIO_ADDR)) {
+        uint32_t data = 0;
+        if (dut->MMIO_WSTRB)
+            bus->write(dut->MMIO_ADDR, dut->MMIO_WDATA, dut->MMIO_WSTRB);
+        else
+            bus->read(dut->MMIO_ADDR, data);
+        dut->MMIO_RDATA = data;
+        dut->MMIO_READY = 1;
+        bus->busy = true;
+    }
+}
+#endif
+
 //----------------------------------------------------------------------------------------------------
 // Single simulation step: toggle clk, evaluate DUT, dump FST trace,
-// and advance simulation time by one half cycle
+// and advance simulation time by one half cycle.
+// Returns false once the last trace window is over; the caller closes the trace.
 //----------------------------------------------------------------------------------------------------
-void sim_step(Vsim* dut, Vtrace* m_trace) {
+bool sim_step(SimContext& sim) {
+    Vsim*   dut     = sim.dut;
+    Vtrace* m_trace = sim.m_trace;
+    const vluint64_t CYCLE = 2 * HALF_CYCLE;
     // Toggle clock.
     dut->CLOCK_SIGNAL = !dut->CLOCK_SIGNAL;
     // Evaluate the design model
+    PROFILE_START(t_eval);
     dut->eval();
-    // Dump simulation data for VCD/FST trace (if needed)
-    if (TRACE_SIGNALS && ((sim_time / 10) >= INIT_TIME_TRACES)) 
-    {
-        m_trace->dump(sim_time);
-    }
-    else if (TRACE_SIGNALS && ((sim_time / 10) >= END_TIME_TRACES)) 
+    PROFILE_STOP(sim, eval, t_eval);
+    #if defined(MMIO_BUS)
+        mmio_service(sim);
+    #endif
+    // Trigger: the windows count from the first cycle where the signal has the value
+    #if defined(TRIGGER_SIGNAL)
+        if (sim.trigger_cycle < 0 && (uint64_t) dut->TRIGGER_SIGNAL == sim.trigger_value)
+            sim.trigger_cycle = sim.sim_time / CYCLE;
+    #endif
+    // Dump simulation data for VCD/FST trace inside the windows (no trace object: nothing to dump)
+    if (TRACE_SIGNALS && m_trace && sim.trigger_cycle >= 0) 
     {
-        m_trace->close();
-        delete dut;
-        delete m_trace;
-        exit(0);
+        vluint64_t t = sim.sim_time - CYCLE * sim.trigger_cycle;
+        while (sim.window < sim.windows.size() && t > CYCLE * sim.windows[sim.window].stop)
+            sim.window++;
+        // Past the last window: nothing more to trace
+        if (sim.window == sim.windows.size())
+            return false;
+        if (t >= CYCLE * sim.windows[sim.window].start) {
+            PROFILE_START(t_dump);
+            m_trace->dump(sim.sim_time);
+            PROFILE_STOP(sim, dump, t_dump);
+        }
     }
     // Check monitored signals
-    // verilog_monitor("leds = %d", dut->leds, &monitor_leds);
+    // verilog_monitor(sim, "leds = %d", dut->leds, &monitor_leds);
     // Increase simulation time by the half cycle.
-    sim_time += HALF_CYCLE;
+    sim.sim_time += HALF_CYCLE;
     // Call the progress bar update function.
-    // update_progress_bar();
+    // update_progress_bar(sim);
+    return true;
 }
 
 //----------------------------------------------------------------------------------------------------
 // Verilog Delay (#) equivalent function
+// Returns false if the simulation cannot continue (MAX_SIM_TIME or end of the trace window).
 //----------------------------------------------------------------------------------------------------
-void verilog_delay(vluint64_t delay, Vsim* dut, Vtrace* m_trace) { 
+bool verilog_delay(vluint64_t delay, SimContext& sim) { 
     // Calculate target time.
-    vluint64_t target_time = sim_time + 2 * HALF_CYCLE * delay - HALF_CYCLE;
+    vluint64_t target_time = sim.sim_time + 2 * HALF_CYCLE * delay - HALF_CYCLE;
     // Prevent overflow (simulation time exceeded allowed MAX_SIM_TIME).
     if (target_time > 2 * HALF_CYCLE * MAX_SIM_TIME) {
-        std::cout << "\nERROR! MAX_SIM_TIME was reached.\nsim_time = " << sim_time 
+        std::cout << "\nERROR! MAX_SIM_TIME was reached.\nsim_time = " << sim.sim_time 
                   << "\ntarget_time = " << target_time << "\nEnd of Simulation...\n";
-        
-        // Remember to close the trace object to save data in the file
-        if (TRACE_SIGNALS) m_trace->close();
-        // Free memory
-        delete dut;
-        delete m_trace;
-        exit(0);
+        return false;
     }
     // Simulate until the target time is reached.
-    while (sim_time <= target_time && sim_time <= 2 * HALF_CYCLE * MAX_SIM_TIME) {
-        sim_step(dut, m_trace);
+    while (sim.sim_time <= target_time && sim.sim_time <= 2 * HALF_CYCLE * MAX_SIM_TIME) {
+        if (!sim_step(sim)) return false;
     }
+    return true;
 }
 
 //----------------------------------------------------------------------------------------------------
@@ -215,37 +278,394 @@ void dec_2_char(int dec, char* dec_char)
 }
 
 //----------------------------------------------------------------------------------------------------
-// Random Generation Function
+// Waveform Stream
 //----------------------------------------------------------------------------------------------------
-uint64_t verilog_random() {
-    // The state is static, so it persists across function calls.
-    // It's initialized to 0 only once by the C runtime.
-    static uint64_t state = 0;
-
-    // Seed the generator ONCE on the first call when state is 0.
-    if (state == 0) {
-        // Combine time and Process ID to create a unique seed for this run.
-        #ifdef _WIN32
-            state = (uint64_t)time(NULL) ^ ((uint64_t)_getpid() << 32);
-        #else
-            state = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
-        #endif
-        // The xorshift algorithm requires a non-zero seed.
-        if (state == 0) { state = 1; }
-        // Initial Randomization
-        for (int i = 0; i < 100; i++)
-        {
-            state ^= state << 13;
-            state ^= state >> 7;
-            state ^= state << 17;
+#if defined(WAVEFORM_TYPE_VCD)
+bool WaveformStream::open(const std::string& name) {
+    if (name == "-")
+        m_fd = dup(STDOUT_FILENO);
+    else
+        // Blocks on a FIFO until the reader opens the other end
+        m_fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    #if defined(SIM_PROFILE)
+        m_bytes = 0;
+    #endif
+    return m_fd >= 0;
+}
+
+void WaveformStream::close() {
+    if (m_fd >= 0) ::close(m_fd);
+    m_fd = -1;
+}
+
+ssize_t WaveformStream::write(const char* bufp, ssize_t len) {
+    ssize_t done = 0;
+    while (done < len) {
+        ssize_t got = ::write(m_fd, bufp + done, len - done);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return done > 0 ? done : -1;
+        }
+        done += got;
+    }
+    #if defined(SIM_PROFILE)
+        m_bytes += done;
+    #endif
+    return done;
+}
+#endif
+
+//----------------------------------------------------------------------------------------------------
+// Toggle Trace
+//----------------------------------------------------------------------------------------------------
+#if defined(WAVEFORM_TYPE_TOGGLE)
+// Verilator identifier: bijective base-94 number, least significant digit first
+static int64_t vcd_code(const char* id, size_t len) {
+    int64_t x = 0, m = 1;
+    if (len == 0 || len > 9) return -1;
+    for (size_t i = 0; i < len; i++) {
+        if (id[i] < '!' || id[i] > '~') return -1;
+        x += m * (id[i] - '!' + (i > 0));
+        m *= 94;
+    }
+    return x;
+}
+
+void ToggleTrace::record(uint32_t label, uint32_t index, uint64_t seed) {
+    m_label = label;
+    m_index = index;
+    m_seed  = seed;
+}
+
+bool ToggleTrace::open(const std::string& name) {
+    m_name = name;
+    m_part.clear();
+    m_body = false;
+    m_var.clear();
+    m_state.clear();
+    m_trace.clear();
+    m_time = -1;
+    m_hd   = 0;
+    m_sync = false;
+    #if defined(SIM_PROFILE)
+        m_bytes = 0;
+    #endif
+    return true;
+}
+
+void ToggleTrace::close() {
+    if (m_name.empty()) return;
+    if (!m_part.empty()) line(m_part.data(), m_part.size());
+    m_part.clear();
+    if (!m_trace.empty() && !save())
+        std::cerr << "Error writing toggle trace " << m_name << std::endl;
+    m_name.clear();
+}
+
+ssize_t ToggleTrace::write(const char* bufp, ssize_t len) {
+    const char* end = bufp + len;
+    const char* p   = bufp;
+    const char* q;
+
+    #if defined(SIM_PROFILE)
+        m_bytes += len;
+    #endif
+    // Finish the line split by the previous write
+    if (!m_part.empty()) {
+        q = (const char*) memchr(p, '\n', end - p);
+        if (q == NULL) {
+            m_part.append(p, end - p);
+            return len;
+        }
+        m_part.append(p, q - p);
+        line(m_part.data(), m_part.size());
+        m_part.clear();
+        p = q + 1;
+    }
+    while (p < end && (q = (const char*) memchr(p, '\n', end - p)) != NULL) {
+        line(p, q - p);
+        p = q + 1;
+    }
+    m_part.assign(p, end - p);
+    return len;
+}
+
+void ToggleTrace::line(const char* ln, size_t len) {
+    const char* sp;
+
+    while (len > 0 && isspace((unsigned char) ln[len - 1])) len--;
+    if (len == 0) return;
+    if (!m_body) {
+        header(ln, len);
+        return;
+    }
+    switch (ln[0]) {
+        case '#': {
+            int64_t t = 0;
+            for (size_t i = 1; i < len && ln[i] >= '0' && ln[i] <= '9'; i++)
+                t = 10 * t + (ln[i] - '0');
+            time(t);
+            break;
+        }
+        case '0':
+        case '1':
+            value(ln, 1, ln + 1, len - 1);
+            break;
+        case 'b':
+        case 'B':
+            sp = (const char*) memchr(ln, ' ', len);
+            if (sp != NULL)
+                value(ln + 1, sp - ln - 1, sp + 1, ln + len - sp - 1);
+            break;
+        default:
+            // Reals, strings and $dumpvars style keywords carry no bits
+            break;
+    }
+}
+
+void ToggleTrace::header(const char* ln, size_t len) {
+    std::istringstream in(std::string(ln, len));
+    std::string key, type, id;
+    uint32_t width;
+
+    if (!(in >> key)) return;
+    if (key == "$enddefinitions") {
+        m_body = true;
+        return;
+    }
+    if (key != "$var" || !(in >> type >> width >> id) || width == 0) return;
+    int64_t x = vcd_code(id.data(), id.size());
+    if (x < 0) return;
+    if ((size_t) x >= m_var.size()) m_var.resize(x + 1);
+    // Aliases share the identifier and the value
+    Var& v = m_var[x];
+    if (v.width == 0) {
+        v.width = width;
+        v.offs  = m_state.size();
+        m_state.resize(m_state.size() + (width + 63) / 64, 0);
+    }
+}
+
+// A new dump closes the previous one: its distance becomes a point of the trace. Inside a window
+// dumps come every HALF_CYCLE; after a gap, the previous dump closed a window and is dropped.
+void ToggleTrace::time(int64_t t) {
+    if (t <= m_time) return;
+    bool gap = m_time < 0 || t > m_time + HALF_CYCLE;
+    if (gap) {
+        m_hd = 0;
+    } else if (m_hd >= TOGGLE_THRESHOLD) {
+        m_trace.push_back((uint32_t) m_hd);
+        m_hd = 0;
+    }
+    m_time = t;
+    m_sync = gap;
+}
+
+// New value of nbits bits (most significant first, zero-extended to the width)
+void ToggleTrace::value(const char* bits, size_t nbits, const char* id, size_t len) {
+    int64_t x = vcd_code(id, len);
+    if (x < 0 || (size_t) x >= m_var.size()) return;
+    Var& v = m_var[x];
+    if (nbits == 0 || nbits > v.width) return;
+
+    uint64_t* st = &m_state[v.offs];
+    size_t nw = (v.width + 63) / 64;
+    uint64_t hd = 0;
+    if (nw == 1) {
+        uint64_t w = 0;
+        for (size_t i = 0; i < nbits; i++)
+            w = (w << 1) | (bits[i] == '1');
+        hd = __builtin_popcountll(st[0] ^ w);
+        st[0] = w;
+    } else {
+        m_val.assign(nw, 0);
+        for (size_t i = 0; i < nbits; i++) {
+            size_t b = nbits - 1 - i;
+            if (bits[i] == '1') m_val[b / 64] |= 1ull << (b % 64);
+        }
+        for (size_t k = 0; k < nw; k++) {
+            hd += __builtin_popcountll(st[k] ^ m_val[k]);
+            st[k] = m_val[k];
         }
     }
+    if (v.seen && !m_sync) m_hd += hd;
+    v.seen = true;
+}
+
+bool ToggleTrace::save() const {
+    size_t n = m_trace.size();
+
+    if (m_name.size() < 4 || m_name.compare(m_name.size() - 4, 4, ".trs") != 0) {
+        FILE* f = fopen(m_name.c_str(), "wb");
+        if (f == NULL) return false;
+        bool ok = fwrite(m_trace.data(), sizeof(uint32_t), n, f) == n;
+        return fclose(f) == 0 && ok;
+    }
+
+    // A record of readvcd's trace set; the first writer fixes the record length
+    trs_meta_t meta = { m_label, m_index, m_seed };
+    return trs_append(m_name.c_str(), m_trace.data(), 1, (uint32_t) n, 0, &meta) == 0;
+}
+#endif
+
+//----------------------------------------------------------------------------------------------------
+// Stimulus File
+//----------------------------------------------------------------------------------------------------
+#define STIM_MAGIC  "HWSTM001"
+#define STIM_HDR_SZ 64
+
+bool StimulusFile::open(const char* name) {
+    close();
+    int fd = ::open(name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "Error opening stimulus file " << name << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+    m_size = st.st_size;
+    if (m_size < STIM_HDR_SZ) {
+        std::cerr << name << ": not a stimulus file, or truncated" << std::endl;
+        ::close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);                        // the mapping stays
+    if (map == MAP_FAILED) {
+        std::cerr << "Error mapping stimulus file " << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    // Little-endian, like the host: the records are read in place as uint64_t, kept aligned by the
+    // header and record sizes
+    m_map = (const uint8_t*) map;
+    memcpy(&m_hdr,    m_map + 8,  4);
+    memcpy(&m_rec,    m_map + 12, 4);
+    memcpy(&m_fixed,  m_map + 16, 4);
+    memcpy(&m_random, m_map + 20, 4);
+    if (memcmp(m_map, STIM_MAGIC, 8) != 0 || m_hdr < STIM_HDR_SZ || m_hdr % 8 != 0 ||
+        m_rec == 0 || m_rec % 8 != 0 ||
+        m_size < m_hdr + (uint64_t) m_rec * ((uint64_t) m_fixed + m_random)) {
+        std::cerr << name << ": not a stimulus file, or truncated" << std::endl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+void StimulusFile::close() {
+    if (m_map) munmap((void*) m_map, m_size);
+    m_map = nullptr;
+    m_fixed = m_random = 0;
+}
+
+const uint64_t* StimulusFile::record(int trace_index, bool is_random) const {
+    uint64_t r;
+    if (!m_map || trace_index < 0) return NULL;
+    if (is_random) {
+        if ((uint64_t) trace_index >= m_random) return NULL;
+        r = (uint64_t) m_fixed + trace_index;
+    } else {
+        if (m_fixed == 0) return NULL;
+        r = trace_index % m_fixed;
+    }
+    return (const uint64_t*) (m_map + m_hdr + r * m_rec);
+}
 
-    // A simple and fast xorshift64 pseudo-random number generator.
-    uint64_t x = state;
-    x ^= x << 13;
-    x ^= x >> 7;
-    x ^= x << 17;
-    state = x; // Update the state for the next call
-    return state;
-}
\ No newline at end of file
+//----------------------------------------------------------------------------------------------------
+// Profiling
+//----------------------------------------------------------------------------------------------------
+#if defined(SIM_PROFILE)
+uint64_t profile_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+long profile_peak_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+// Appends one line per run: JSON objects if the name ends in .json, CSV (header on a new file) otherwise
+void profile_write(const char* file, const std::vector<SimProfile>& runs) {
+    size_t n    = strlen(file);
+    bool   json = n >= 5 && strcmp(file + n - 5, ".json") == 0;
+    struct stat st;
+    bool   header = !json && (stat(file, &st) != 0 || st.st_size == 0);
+
+    FILE* f = fopen(file, "a");
+    if (f == NULL) {
+        std::cerr << "Error writing profile " << file << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    if (header)
+        fprintf(f, "index,class,worker,cycles,wall_ns,eval_ns,evals,dump_ns,dumps,close_ns,bytes,"
+                   "cycles_per_s,peak_rss_kb\n");
+    for (const SimProfile& r : runs) {
+        double cps = r.wall_ns > 0 ? r.cycles * 1e9 / r.wall_ns : 0.0;
+        if (json)
+            fprintf(f, "{\"index\": %d, \"class\": \"%s\", \"worker\": %u, \"cycles\": %llu, "
+                       "\"wall_ns\": %llu, \"eval_ns\": %llu, \"evals\": %llu, \"dump_ns\": %llu, "
+                       "\"dumps\": %llu, \"close_ns\": %llu, \"bytes\": %llu, \"cycles_per_s\": %.0f, "
+                       "\"peak_rss_kb\": %ld}\n",
+                    r.trace_index, r.is_random ? "random" : "fixed", r.worker, (unsigned long long) r.cycles,
+                    (unsigned long long) r.wall_ns, (unsigned long long) r.eval_ns, (unsigned long long) r.evals,
+                    (unsigned long long) r.dump_ns, (unsigned long long) r.dumps, (unsigned long long) r.close_ns,
+                    (unsigned long long) r.bytes, cps, r.peak_rss_kb);
+        else
+            fprintf(f, "%d,%s,%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.0f,%ld\n",
+                    r.trace_index, r.is_random ? "random" : "fixed", r.worker, (unsigned long long) r.cycles,
+                    (unsigned long long) r.wall_ns, (unsigned long long) r.eval_ns, (unsigned long long) r.evals,
+                    (unsigned long long) r.dump_ns, (unsigned long long) r.dumps, (unsigned long long) r.close_ns,
+                    (unsigned long long) r.bytes, cps, r.peak_rss_kb);
+    }
+    fclose(f);
+}
+
+// Totals of all runs on stderr. Workers overlap, so the times add up to more than the wall clock.
+void profile_summary(const std::vector<SimProfile>& runs) {
+    SimProfile t;
+    for (const SimProfile& r : runs) {
+        t.cycles   += r.cycles;
+        t.wall_ns  += r.wall_ns;
+        t.eval_ns  += r.eval_ns;
+        t.dump_ns  += r.dump_ns;
+        t.close_ns += r.close_ns;
+        t.bytes    += r.bytes;
+    }
+    double wall = t.wall_ns > 0 ? (double) t.wall_ns : 1.0;
+    fprintf(stderr, "Profile: %zu runs, %llu cycles, %.0f cycles/s per run; eval %.1f%%, dump %.1f%%, "
+                    "close %.1f%%; %.1f MB of waveform; peak RSS %.1f MB\n",
+            runs.size(), (unsigned long long) t.cycles, t.cycles * 1e9 / wall,
+            100.0 * t.eval_ns / wall, 100.0 * t.dump_ns / wall, 100.0 * t.close_ns / wall,
+            t.bytes / 1e6, profile_peak_rss_kb() / 1024.0);
+}
+#endif
+
+//----------------------------------------------------------------------------------------------------
+// Random Generation Function
+//----------------------------------------------------------------------------------------------------
+// SplitMix64 output function: a bijective mix of the 64 bits
+static inline uint64_t splitmix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Key of one stream of a campaign seed (trace_stream(), or any other number for other uses)
+uint64_t random_key(uint64_t seed, uint64_t stream) {
+    return splitmix64(seed ^ splitmix64(stream + 0x9E3779B97F4A7C15ULL));
+}
+
+// Start the stream of a key from its first number
+void verilog_random_seed(SimContext& sim, uint64_t key) {
+    sim.rng_key     = key;
+    sim.rng_counter = 0;
+}
+
+uint64_t verilog_random(SimContext& sim) {
+    // Number rng_counter of the stream: nothing but the key and the counter is kept, so the context
+    // can be copied, restarted or moved to another thread without changing the sequence.
+    sim.rng_counter++;
+    return splitmix64(sim.rng_key + sim.rng_counter * 0x9E3779B97F4A7C15ULL);
+}
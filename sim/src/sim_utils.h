@@ -11,8 +11,16 @@
 #include <string.h>
 #include <cstring>
 #include <cassert>
+#include <string>
+#include <vector>
+
+#include "mmio.h"
 
 #include <verilated.h>
+#if defined(SIM_SAVABLE)
+    // Model built with --savable: checkpoints through VerilatedSave / VerilatedRestore
+    #include <verilated_save.h>
+#endif
 
 #define PASTE_IMPL(a, b) a##b
 #define PASTE(a, b) PASTE_IMPL(a, b)
@@ -38,6 +46,12 @@
     using Vtrace = VerilatedVcdC;
     #define WAVEFORM_EXTENSION ".vcd"
     #define TRACE_SIGNALS       true
+#elif defined(WAVEFORM_TYPE_TOGGLE)
+    #include <verilated_vcd_c.h>
+    // The VCD tracer writes into a ToggleTrace, which keeps the toggle trace instead of a waveform
+    using Vtrace = VerilatedVcdC;
+    #define WAVEFORM_EXTENSION ".bin"
+    #define TRACE_SIGNALS       true
 #else
     #include <verilated_fst_c.h>
     using Vtrace = VerilatedFstC;
@@ -54,6 +68,8 @@
 // Waveform Configuration
 //----------------------------------------------------------------------------------------------------
 #define DEPTH_LEVELS    10
+// Smallest Hamming distance kept as a point of a toggle trace (readvcd default threshold)
+#define TOGGLE_THRESHOLD 1
 
 //----------------------------------------------------------------------------------------------------
 // Clock Timing Parameters
@@ -68,15 +84,78 @@
 // #define MAX_SIM_TIME    100
 
 //----------------------------------------------------------------------------------------------------
-// Global Simulation Time Declaration
+// Profiling
+//----------------------------------------------------------------------------------------------------
+#if defined(SIM_PROFILE)
+// Where the time of one run goes (monotonic clock, ns), with the size of its waveform. Built only
+// with SIM_PROFILE: otherwise the PROFILE_ macros are empty and nothing is measured.
+struct SimProfile {
+    int         trace_index = 0;
+    bool        is_random   = false;
+    uint32_t    worker      = 0;
+    vluint64_t  cycles      = 0;            // clock cycles simulated
+    uint64_t    wall_ns     = 0;            // whole run, from sim_reset() to the closed trace
+    uint64_t    eval_ns     = 0, evals  = 0;
+    uint64_t    dump_ns     = 0, dumps  = 0;
+    uint64_t    close_ns    = 0, closes = 0;
+    uint64_t    bytes       = 0;            // waveform written (toggle: VCD decoded in memory)
+    long        peak_rss_kb = 0;            // of the process, at the end of the run
+};
+uint64_t profile_now();
+long profile_peak_rss_kb();
+void profile_write(const char* file, const std::vector<SimProfile>& runs);
+void profile_summary(const std::vector<SimProfile>& runs);
+    #define PROFILE_START(t)            uint64_t t = profile_now()
+    #define PROFILE_STOP(sim, f, t)     do { (sim).profile.f##_ns += profile_now() - (t); (sim).profile.f##s++; } while (0)
+#else
+    #define PROFILE_START(t)
+    #define PROFILE_STOP(sim, f, t)
+#endif
+
+//----------------------------------------------------------------------------------------------------
+// Simulation Context
 //----------------------------------------------------------------------------------------------------
-extern vluint64_t sim_time;
+// Trace window in clock cycles: dumps from start to stop; the dump at stop closes the last point
+struct TraceWindow {
+    vluint64_t start;
+    vluint64_t stop;
+};
+
+// State of one simulation: its model, trace, time, random generator and progress bar. Worker
+// threads each own a context, so nothing below is shared between simulations.
+struct SimContext {
+    VerilatedContext* contextp  = nullptr;      // Verilator context of the model
+    Vsim*       dut             = nullptr;      // Design Top Module
+    Vtrace*     m_trace         = nullptr;      // Trace of the current run
+    vluint64_t  sim_time        = 0;            // Simulation time
+    uint32_t    id              = 0;            // Worker number
+    uint64_t    rng_key         = 0;            // verilog_random() stream, set by verilog_random_seed()
+    uint64_t    rng_counter     = 0;            // verilog_random() numbers drawn from the stream
+    vluint64_t  next_update     = 0;            // update_progress_bar(): next threshold
+    bool        progress_active = true;         // update_progress_bar(): not finished
+
+    // Trace windows, sorted; the model is only dumped inside them. With a trigger armed
+    // (TRIGGER_SIGNAL == trigger_value, like a scope trigger) they count from the trigger cycle.
+    std::vector<TraceWindow> windows = {{INIT_TIME_TRACES, END_TIME_TRACES}};
+    bool        trigger_armed   = false;
+    uint64_t    trigger_value   = 0;
+    int64_t     trigger_cycle   = 0;            // cycle the windows count from, -1: not fired yet
+    size_t      window          = 0;            // current or next window
+    MmioBus*    mmio            = nullptr;      // fast peripheral models (mmio.h), NULL: all RTL
+
+    #if defined(SIM_PROFILE)
+        SimProfile  profile;                    // current run, restarted by sim_reset()
+    #endif
+};
+
+// Restart the time (and progress bar, windows, trigger and peripherals) of a context for a new run
+void sim_reset(SimContext& sim);
 
 //----------------------------------------------------------------------------------------------------
 // Verilog-like $display and $monitor Prototypes
 //----------------------------------------------------------------------------------------------------
-void verilog_display(bool prepend_time, const char* format, ...);
-void verilog_monitor(const char* format, int current_value, int* last_value);
+void verilog_display(const SimContext& sim, bool prepend_time, const char* format, ...);
+void verilog_monitor(const SimContext& sim, const char* format, int current_value, int* last_value);
 
 //----------------------------------------------------------------------------------------------------
 // Get a Single Character
@@ -86,24 +165,132 @@ int getch(void);
 //----------------------------------------------------------------------------------------------------
 // Simulation Control Prototypes
 //----------------------------------------------------------------------------------------------------
-void sim_step(Vsim* dut, Vtrace* m_trace);
-void verilog_delay(vluint64_t delay, Vsim* dut, Vtrace* m_trace);
+// Both return false when the run has to end (past the last trace window, MAX_SIM_TIME); the trace
+// is then closed by the caller
+bool sim_step(SimContext& sim);
+bool verilog_delay(vluint64_t delay, SimContext& sim);
 
 //----------------------------------------------------------------------------------------------------
 // Progress Bar
 //----------------------------------------------------------------------------------------------------
 void clear_progress_bar();
-void update_progress_bar();
+void update_progress_bar(SimContext& sim);
 
 //----------------------------------------------------------------------------------------------------
 // Int Decimal to Char array
 //----------------------------------------------------------------------------------------------------
 void dec_2_char(int dec, char* dec_char);
 
+//----------------------------------------------------------------------------------------------------
+// Waveform Stream
+//----------------------------------------------------------------------------------------------------
+#if defined(WAVEFORM_TYPE_VCD)
+// VCD output file that can also be a named pipe or stdout ("-"). The default Verilator file opens
+// non-blocking, which fails on a FIFO whose reader has not opened it yet; this one blocks instead.
+class WaveformStream : public VerilatedVcdFile {
+  public:
+    bool open(const std::string& name) override;
+    void close() override;
+    ssize_t write(const char* bufp, ssize_t len) override;
+    #if defined(SIM_PROFILE)
+        uint64_t bytes() const { return m_bytes; }
+    #endif
+  private:
+    int m_fd = -1;
+    #if defined(SIM_PROFILE)
+        uint64_t m_bytes = 0;           // written since open()
+    #endif
+};
+#endif
+
+//----------------------------------------------------------------------------------------------------
+// Toggle Trace
+//----------------------------------------------------------------------------------------------------
+#if defined(WAVEFORM_TYPE_TOGGLE)
+// In-process toggle counting. Verilator's VCD tracer only formats the signals that changed in a dump;
+// this file object decodes those records straight from its buffer and keeps the Hamming distance of
+// every dump, as readvcd does. sim_step() only dumps inside the trace windows: the first dump of a
+// window (after a time gap) refreshes the values, and the last one closes the window, so neither
+// is a point. No waveform is stored. On close() the trace is written as readvcd would: uint32
+// distances (.bin) or a trace-set record (.trs).
+class ToggleTrace : public VerilatedVcdFile {
+  public:
+    bool open(const std::string& name) override;
+    void close() override;
+    ssize_t write(const char* bufp, ssize_t len) override;
+    // Class, index and seed of the trace-set record
+    void record(uint32_t label, uint32_t index, uint64_t seed);
+    #if defined(SIM_PROFILE)
+        uint64_t bytes() const { return m_bytes; }
+    #endif
+  private:
+    struct Var {
+        uint32_t width = 0;             // bits, 0 if not declared
+        uint32_t offs  = 0;             // first word of the value in m_state
+        bool     seen  = false;         // has a value; the first one is not a toggle
+    };
+    void line(const char* ln, size_t len);
+    void header(const char* ln, size_t len);
+    void time(int64_t t);
+    void value(const char* bits, size_t nbits, const char* id, size_t len);
+    bool save() const;
+
+    std::string m_name;                 // output file
+    std::string m_part;                 // line split between two writes
+    bool m_body = false;                // past $enddefinitions
+    std::vector<Var> m_var;             // by identifier code
+    std::vector<uint64_t> m_state;      // current values, 64 bits per word
+    std::vector<uint64_t> m_val;        // value being decoded
+    std::vector<uint32_t> m_trace;      // the toggle trace
+    int64_t  m_time = -1;               // time of the current dump
+    uint64_t m_hd   = 0;                // distance since the last point
+    bool m_sync = false;                // first dump of a window: values only
+    uint32_t m_label = 0, m_index = 0;
+    uint64_t m_seed  = 0;
+    #if defined(SIM_PROFILE)
+        uint64_t m_bytes = 0;           // VCD decoded since open()
+    #endif
+};
+#endif
+
+//----------------------------------------------------------------------------------------------------
+// Stimulus File
+//----------------------------------------------------------------------------------------------------
+// Inputs of the traces, written by traces/src/genstim: a 64-byte header ("HWSTM001", header size,
+// record size, fixed and random record counts) and fixed-size records of 64-bit little-endian words.
+// The file is mapped read-only and shared by all workers; a trace finds its record by index.
+class StimulusFile {
+  public:
+    ~StimulusFile() { close(); }
+    bool open(const char* name);        // false (with a message) if it is not a stimulus file
+    void close();
+    // Fixed records repeat over the trace index, random ones are one per index. NULL: no record.
+    const uint64_t* record(int trace_index, bool is_random) const;
+    uint32_t words()  const { return m_rec / 8; }
+    uint32_t fixed()  const { return m_fixed; }
+    uint32_t random() const { return m_random; }
+  private:
+    const uint8_t* m_map = nullptr;
+    size_t   m_size   = 0;
+    uint32_t m_hdr    = 0;              // header size
+    uint32_t m_rec    = 0;              // record size (bytes)
+    uint32_t m_fixed  = 0;
+    uint32_t m_random = 0;
+};
+
 //----------------------------------------------------------------------------------------------------
 // Random Generation Function
 //----------------------------------------------------------------------------------------------------
-uint64_t verilog_random();
+// Counter-based (SplitMix64): the n-th number of a stream only depends on its key and n, so a trace
+// draws the same inputs whatever worker simulates it and in whatever order
+uint64_t random_key(uint64_t seed, uint64_t stream);
+void verilog_random_seed(SimContext& sim, uint64_t key);
+uint64_t verilog_random(SimContext& sim);
+
+// Stream of the inputs of a trace: one per index and class
+inline uint64_t trace_stream(int trace_index, bool is_random) {
+    return ((uint64_t) trace_index << 1) | is_random;
+}
 
 
 #endif // SIM_UTILS_H
@@ -2,8 +2,560 @@
 #include <iostream>
 #include <cstdarg>
 #include <cstdio>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <verilated.h>
-#include "sim_utils.h"          // Contains the configuration, sim_time, and simulation helper prototypes
+#include "sim_utils.h"          // Contains the configuration, simulation context, and simulation helper prototypes
+#if defined(SIM_PROFILE)
+    #include <sys/stat.h>           // Size of the waveform files written by Verilator
+#endif
+#if defined(FAULT_SIGNAL)
+    #include TOP_ROOT_HEADER    // Public signals of the model, for fault injection
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------
+// Waveform file name
+//----------------------------------------------------------------------------------------------------
+// Default sim/waveform[_<i>].<ext>, sim/waveform_<class>_<i>.<ext> in a campaign. In a given path, "{class}" and "{index}" are replaced by
+// fixed/random and the trace index, so a campaign can write one file per trace.
+static void waveform_name(char* waveform_file, size_t size, const char* waveform_path, int trace_index, bool is_random,
+                          bool campaign)
+{
+    char index[32];
+    dec_2_char(trace_index, index);
+
+    std::string name = "sim/waveform";
+    if (waveform_path)
+    {
+        name = waveform_path;
+    }
+    else
+    {
+        // A campaign writes one waveform per trace, fixed i and random i included
+        if (campaign)
+        {
+            name += "_{class}_{index}";
+        }
+        else
+        {
+            #if defined(WAVEFORM_TYPE_VCD) || defined(WAVEFORM_TYPE_TOGGLE)
+                name += "_{index}";
+            #endif
+        }
+        name += WAVEFORM_EXTENSION;
+    }
+
+    size_t pos;
+    while ((pos = name.find("{class}")) != std::string::npos)
+        name.replace(pos, 7, is_random ? "random" : "fixed");
+    while ((pos = name.find("{index}")) != std::string::npos)
+        name.replace(pos, 7, index);
+
+    strncpy(waveform_file, name.c_str(), size - 1);
+    waveform_file[size - 1] = '\0';
+}
+
+//----------------------------------------------------------------------------------------------------
+// Fast peripherals
+//----------------------------------------------------------------------------------------------------
+// Input of the UART model from the command line: \r, \n, \t, \\ and \xHH escapes
+static std::string unescape(const char* s)
+{
+    std::string out;
+    for (; *s != '\0'; s++)
+    {
+        if (*s != '\\' || s[1] == '\0')
+        {
+            out += *s;
+            continue;
+        }
+        switch (*++s)
+        {
+            case 'r': out += '\r'; break;
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'x':
+            {
+                char* end;
+                char hex[3] = {s[1], s[1] ? s[2] : '\0', '\0'};
+                out += (char) strtoul(hex, &end, 16);
+                s += end - hex;
+                break;
+            }
+            default:  out += *s; break;
+        }
+    }
+    return out;
+}
+
+// Models of a simulation: peripherals switched as in --mmio, bound for the DPI calls of its thread
+static void attach_mmio(SimContext& sim, MmioBus& bus, const std::string& peripherals, const std::string& uart_input)
+{
+    bus.configure(peripherals);
+    bus.uart.input = uart_input;
+    sim.mmio = &bus;
+    mmio_bind(&bus);
+}
+
+//----------------------------------------------------------------------------------------------------
+// Workers
+//----------------------------------------------------------------------------------------------------
+// Each worker thread owns a Verilator context, a model, a trace sink, its peripheral models and its
+// simulation context
+struct Worker {
+    SimContext sim;
+    MmioBus    mmio;
+    #if defined(WAVEFORM_TYPE_VCD)
+        WaveformStream waveform_stream;
+    #elif defined(WAVEFORM_TYPE_TOGGLE)
+        ToggleTrace toggle_trace;
+    #endif
+};
+
+// One trace of the campaign; workers take them in order from a shared counter
+struct Job {
+    int  trace_index;
+    bool is_random;
+};
+
+// What every worker shares
+struct Campaign {
+    std::vector<Job> jobs;
+    std::atomic<size_t> next{0};        // next job to take
+    const char* waveform_path = NULL;
+    int  num_traces = 0;                // shown in the progress line (0: single trace)
+    uint64_t seed   = 0;                // campaign seed: the inputs of a trace follow from it
+    const StimulusFile* stimulus = NULL;    // inputs read from a file instead, if any
+    int  prefix     = 0;                // cycles after the reset that every trace shares
+    const char* checkpoint = NULL;      // state saved after the prefix, if any
+    std::vector<TraceWindow> windows;   // trace windows, in cycles
+    bool trigger_armed      = false;    // windows count from TRIGGER_SIGNAL == trigger_value
+    uint64_t trigger_value  = 0;
+    std::string mmio;                   // peripherals served by the models (--mmio)
+    std::string uart_input;             // what the firmware reads from the UART model
+    FILE* uart_out  = NULL;             // what it printed, after each trace (progress_mutex)
+    bool uart_label = false;            // one labelled block per trace (--uart_out)
+    #if defined(SIM_PROFILE)
+        std::vector<SimProfile> profile;    // one entry per finished trace (progress_mutex)
+    #endif
+};
+
+static std::mutex progress_mutex;
+
+//----------------------------------------------------------------------------------------------------
+// Shared prefix: reset, then the cycles that are the same for every trace (warmup, firmware boot)
+//----------------------------------------------------------------------------------------------------
+static bool run_prefix(SimContext& sim, int prefix)
+{
+    Vsim* dut = sim.dut;
+
+    dut->rst_n = 0;
+    bool running = verilog_delay(10, sim);
+    dut->rst_n = 1;
+
+    if (running && prefix > 0)
+    {
+        running = verilog_delay(prefix, sim);
+    }
+    return running;
+}
+
+#if defined(SIM_SAVABLE)
+//----------------------------------------------------------------------------------------------------
+// Checkpoint: time and model state at the end of the prefix (Verilator --savable)
+//----------------------------------------------------------------------------------------------------
+static void save_checkpoint(const char* file, const Campaign& c)
+{
+    SimContext sim;
+    MmioBus    mmio;
+    sim.contextp = new VerilatedContext;
+    sim.dut      = new Vsim(sim.contextp);
+    sim.trigger_armed = c.trigger_armed;
+    sim.trigger_value = c.trigger_value;
+    attach_mmio(sim, mmio, c.mmio, c.uart_input);
+    sim_reset(sim);
+
+    // No trace object: nothing is dumped while the prefix is simulated
+    if (!run_prefix(sim, c.prefix))
+    {
+        std::cerr << "Error: the prefix does not fit in MAX_SIM_TIME" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!c.trigger_armed && sim.sim_time > 2*HALF_CYCLE*c.windows[0].start)
+    {
+        std::cerr << "Warning: the first trace window is inside the prefix; traces start at cycle "
+                  << sim.sim_time / (2*HALF_CYCLE) << std::endl;
+    }
+
+    VerilatedSave os;
+    os.open(file);
+    uint64_t trigger = sim.trigger_cycle;  // the trigger may fire inside the prefix (-1: not yet)
+    os << sim.sim_time;
+    os << trigger;
+    // Peripheral models: what the firmware printed and read during the prefix
+    uint64_t received = mmio.uart.received;
+    os << mmio.uart.output << received << mmio.uart.clkdiv << mmio.leds.value << mmio.leds.writes << mmio.busy;
+    os << *sim.dut;
+    os.close();
+
+    mmio_bind(NULL);
+    delete sim.dut;
+    delete sim.contextp;
+}
+
+static void restore_checkpoint(SimContext& sim, const char* file)
+{
+    VerilatedRestore os;
+    os.open(file);
+    uint64_t trigger, received;
+    MmioBus& mmio = *sim.mmio;
+    os >> sim.sim_time;
+    os >> trigger;
+    os >> mmio.uart.output >> received >> mmio.uart.clkdiv >> mmio.leds.value >> mmio.leds.writes >> mmio.busy;
+    os >> *sim.dut;
+    sim.trigger_cycle   = (int64_t) trigger;
+    mmio.uart.received  = received;
+    os.close();
+}
+#endif
+
+//----------------------------------------------------------------------------------------------------
+// Single trace: simulate the DUT from reset (or from the checkpoint) with a new trace object
+//----------------------------------------------------------------------------------------------------
+// Words of a stimulus record read by the Test Values below (STIM_WORDS of make stimulus)
+static const uint32_t STIMULUS_WORDS = 8;
+
+static void run_trace(Worker& w, const Job& job, Campaign& c)
+{
+    SimContext& sim = w.sim;
+    Vsim* dut       = sim.dut;
+    bool running    = true;
+
+    // Restart the time and bring the clock low, as after construction, or load the saved prefix
+    sim_reset(sim);
+    // Random inputs depend only on the campaign seed, index and class, not on the worker or order
+    verilog_random_seed(sim, random_key(c.seed, trace_stream(job.trace_index, job.is_random)));
+    sim.contextp->randSeed((int) (sim.rng_key >> 33) | 1);
+    if (c.checkpoint)
+    {
+        #if defined(SIM_SAVABLE)
+            restore_checkpoint(sim, c.checkpoint);
+        #endif
+    }
+    else if (dut->CLOCK_SIGNAL)
+    {
+        dut->CLOCK_SIGNAL = 0;
+        dut->eval();
+    }
+    #if defined(SIM_PROFILE)
+        uint64_t   t_start    = profile_now();
+        vluint64_t time_start = sim.sim_time;
+        sim.profile.trace_index = job.trace_index;
+        sim.profile.is_random   = job.is_random;
+        sim.profile.worker      = sim.id;
+    #endif
+
+    // A new trace object per trace: it starts with a full dump at its first time, as in a new process
+    #if defined(WAVEFORM_TYPE_VCD)
+        // Explicit paths may be pipes, so they go through a blocking stream file
+        Vtrace *m_trace = c.waveform_path ? new Vtrace(&w.waveform_stream) : new Vtrace;
+    #elif defined(WAVEFORM_TYPE_TOGGLE)
+        // Value changes are counted in memory; only the toggle trace is written
+        w.toggle_trace.record(job.is_random, job.trace_index, c.seed);
+        Vtrace *m_trace = new Vtrace(&w.toggle_trace);
+    #else
+        Vtrace *m_trace = new Vtrace;   // Trace
+    #endif
+    sim.m_trace = m_trace;
+
+    // Trace configuration
+    if (TRACE_SIGNALS)
+    {
+        dut->trace(m_trace, DEPTH_LEVELS);        		            // Set depth levels of the trace
+
+        char waveform_file[256];
+        waveform_name(waveform_file, sizeof(waveform_file), c.waveform_path, job.trace_index, job.is_random,
+                      c.num_traces > 0);
+
+        m_trace->open((const char*) waveform_file); 		        // Open the Waveform file to store data
+    }
+
+    if (!c.checkpoint)
+    {
+        running = run_prefix(sim, c.prefix);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    // Test Values
+    //------------------------------------------------------------------------------------------------
+    // Everything that differs between traces goes after the prefix, so that the prefix can be saved
+
+    // Record of this trace in the stimulus file (--stimulus), read in place: 64-bit words
+    const uint64_t* stimulus = c.stimulus ? c.stimulus->record(job.trace_index, job.is_random) : NULL;
+
+    if (stimulus)
+    {
+        /* private_key[0] = stimulus[0];
+        private_key[1] = stimulus[1];
+        private_key[2] = stimulus[2];
+        private_key[3] = stimulus[3];
+
+        public_key[0] = stimulus[4]; 
+        public_key[1] = stimulus[5];
+        public_key[2] = stimulus[6];
+        public_key[3] = stimulus[7]; */
+    }
+    else if (!job.is_random)
+    {
+        /* private_key[0] = 0x01dce7bc4bdadd91;
+        private_key[1] = 0x5bfd44842512d795;
+        private_key[2] = 0x6476155515f4b2f2;
+        private_key[3] = 0x69f592120fb60f46;
+
+        public_key[0] = 0x575D25B579CAD038; 
+        public_key[1] = 0x0AA0CC335924119A;
+        public_key[2] = 0x9C9B21B7FC74E4E7;
+        public_key[3] = 0x0A4AB26A652CA791; */
+    }
+    else
+    {
+        /* private_key[0] = verilog_random(sim);
+        private_key[1] = verilog_random(sim);
+        private_key[2] = verilog_random(sim);
+        private_key[3] = verilog_random(sim);
+
+        public_key[0] = verilog_random(sim); 
+        public_key[1] = verilog_random(sim);
+        public_key[2] = verilog_random(sim);
+        public_key[3] = verilog_random(sim); */
+    }
+
+    // Simulate until max simulation time is reached
+    while (running && sim.sim_time <= 2*HALF_CYCLE*MAX_SIM_TIME) 
+    {
+        running = sim_step(sim) && sim_step(sim);
+    }
+
+    // Remember to close the trace object to save data in the file
+    PROFILE_START(t_close);
+    if (TRACE_SIGNALS) m_trace->close();
+    PROFILE_STOP(sim, close, t_close);
+    delete m_trace;
+    sim.m_trace = nullptr;
+
+    // What the firmware printed through the UART model
+    if (c.uart_out && !w.mmio.uart.output.empty())
+    {
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        if (c.uart_label)
+        {
+            fprintf(c.uart_out, "--- %s trace %d ---\n", job.is_random ? "random" : "fixed", job.trace_index);
+        }
+        fwrite(w.mmio.uart.output.data(), 1, w.mmio.uart.output.size(), c.uart_out);
+        fflush(c.uart_out);
+    }
+
+    #if defined(SIM_PROFILE)
+        sim.profile.cycles      = (sim.sim_time - time_start) / (2*HALF_CYCLE);
+        sim.profile.wall_ns     = profile_now() - t_start;
+        sim.profile.peak_rss_kb = profile_peak_rss_kb();
+        // Bytes through the sinks of this testbench; files written by Verilator are measured on disk
+        #if defined(WAVEFORM_TYPE_TOGGLE)
+            sim.profile.bytes = w.toggle_trace.bytes();
+        #else
+            #if defined(WAVEFORM_TYPE_VCD)
+                if (c.waveform_path) sim.profile.bytes = w.waveform_stream.bytes();
+            #endif
+            char waveform_file[256];
+            struct stat st;
+            waveform_name(waveform_file, sizeof(waveform_file), c.waveform_path, job.trace_index, job.is_random,
+                          c.num_traces > 0);
+            if (TRACE_SIGNALS && sim.profile.bytes == 0 && stat(waveform_file, &st) == 0 && S_ISREG(st.st_mode))
+            {
+                sim.profile.bytes = st.st_size;
+            }
+        #endif
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        c.profile.push_back(sim.profile);
+    #endif
+}
+
+//----------------------------------------------------------------------------------------------------
+// Worker thread: build the model, then simulate traces until the queue is empty
+//----------------------------------------------------------------------------------------------------
+static void run_worker(Worker* w, Campaign* c)
+{
+    SimContext& sim = w->sim;
+
+    // Construct the Verilator context and design object; trace objects are created per trace
+    sim.contextp = new VerilatedContext;
+    if (TRACE_SIGNALS)
+    {
+        sim.contextp->traceEverOn(true);     			            // Turn on trace switch in context
+    }
+	sim.dut = new Vsim(sim.contextp);       // Design Top Module
+
+    // Trace windows and trigger, restarted by sim_reset() for every trace
+    sim.windows       = c->windows;
+    sim.trigger_armed = c->trigger_armed;
+    sim.trigger_value = c->trigger_value;
+    // Peripheral models; DPI calls come from the eval() of this thread
+    attach_mmio(sim, w->mmio, c->mmio, c->uart_input);
+
+    size_t j;
+    while ((j = c->next.fetch_add(1)) < c->jobs.size())
+    {
+        const Job& job = c->jobs[j];
+        if (c->num_traces > 0)
+        {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            printf(" Simulating %-6s trace %d/%d (%zu/%zu)...\r", job.is_random ? "random" : "fixed", job.trace_index, c->num_traces,
+                   j + 1, c->jobs.size());
+            fflush(stdout);
+        }
+        run_trace(*w, job, *c);
+    }
+
+    // Free memory
+    mmio_bind(NULL);
+    delete sim.dut;
+    delete sim.contextp;
+}
+
+#if defined(FAULT_SIGNAL)
+//----------------------------------------------------------------------------------------------------
+// Fault Injection
+//----------------------------------------------------------------------------------------------------
+// Single-bit upsets of FAULT_SIGNAL (a /*verilator public*/ signal) at every cycle of a window.
+// The fault-free run is simulated once and its FAULT_OUTPUT kept per cycle. A second run fork()s at
+// each injection cycle: every child flips one bit and runs to the end, comparing the output with the
+// fault-free run, while the parent goes on to the next cycle. Children share the parent's memory
+// copy-on-write, so each fault costs only the cycles after it.
+struct FaultResult {
+    int64_t  diverged;                  // first cycle where the output differs, -1: never
+    uint64_t output;                    // output at the end of the run
+    int      done;                      // set by the child when it finishes
+};
+
+static void fault_model(SimContext& sim)
+{
+    sim.contextp = new VerilatedContext;
+	sim.dut = new Vsim(sim.contextp);       // Design Top Module, without trace
+    sim_reset(sim);
+}
+
+static void run_faults(int prefix, int64_t from, int64_t to, int jobs, const char* out_file,
+                       const std::string& peripherals, const std::string& uart_input)
+{
+    SimContext sim;
+    MmioBus    mmio;                    // copied into every child by fork()
+    attach_mmio(sim, mmio, peripherals, uart_input);
+    std::vector<uint64_t> golden(MAX_SIM_TIME + 1, 0);
+    const int64_t CYCLE = 2*HALF_CYCLE;
+
+    // Fault-free run
+    fault_model(sim);
+    bool running = run_prefix(sim, prefix);
+    while (running && sim.sim_time <= 2*HALF_CYCLE*MAX_SIM_TIME) 
+    {
+        golden[sim.sim_time / CYCLE] = (uint64_t) sim.dut->FAULT_OUTPUT;
+        running = sim_step(sim) && sim_step(sim);
+    }
+    uint64_t golden_output = (uint64_t) sim.dut->FAULT_OUTPUT;
+    delete sim.dut;
+    delete sim.contextp;
+
+    // One result per fault, written by the children into shared memory
+    size_t num_faults = (to > from ? to - from : 0) * FAULT_WIDTH;
+    FaultResult* results = (FaultResult*) mmap(NULL, std::max<size_t>(num_faults, 1) * sizeof(FaultResult),
+                                               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    // Injection run
+    int active = 0;
+    fault_model(sim);
+    running = run_prefix(sim, prefix);
+    while (running && sim.sim_time <= 2*HALF_CYCLE*MAX_SIM_TIME) 
+    {
+        int64_t cycle = sim.sim_time / CYCLE;
+        for (int bit = 0; cycle >= from && cycle < to && bit < FAULT_WIDTH; bit++)
+        {
+            if (active >= jobs)
+            {
+                wait(NULL);
+                active--;
+            }
+            printf(" Injecting cycle %ld bit %d...\r", (long) cycle, bit);
+            fflush(stdout);
+
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                perror("fork");
+                exit(EXIT_FAILURE);
+            }
+            if (pid == 0)
+            {
+                FaultResult& r = results[(cycle - from) * FAULT_WIDTH + bit];
+                r.diverged = -1;
+                sim.dut->FAULT_SIGNAL ^= 1ull << bit;
+                while (running && sim.sim_time <= 2*HALF_CYCLE*MAX_SIM_TIME) 
+                {
+                    int64_t c = sim.sim_time / CYCLE;
+                    if (r.diverged < 0 && (uint64_t) sim.dut->FAULT_OUTPUT != golden[c])
+                        r.diverged = c;
+                    running = sim_step(sim) && sim_step(sim);
+                }
+                r.output = (uint64_t) sim.dut->FAULT_OUTPUT;
+                r.done   = 1;
+                _exit(EXIT_SUCCESS);
+            }
+            active++;
+        }
+        running = sim_step(sim) && sim_step(sim);
+    }
+    while (active > 0 && wait(NULL) > 0)
+    {
+        active--;
+    }
+    clear_progress_bar();
+    delete sim.dut;
+    delete sim.contextp;
+
+    // Results table
+    FILE* f = out_file ? fopen(out_file, "w") : stdout;
+    if (f == NULL)
+    {
+        perror(out_file);
+        exit(EXIT_FAILURE);
+    }
+    size_t count[4] = {0, 0, 0, 0};
+    const char* effect[4] = {"masked", "transient", "corrupt", "crash"};
+    fprintf(f, "cycle,bit,diverged,output,golden,effect\n");
+    for (size_t k = 0; k < num_faults; k++)
+    {
+        const FaultResult& r = results[k];
+        int e = !r.done ? 3 : r.diverged < 0 ? 0 : r.output == golden_output ? 1 : 2;
+        count[e]++;
+        fprintf(f, "%ld,%d,%ld,%lu,%lu,%s\n", (long) (from + k / FAULT_WIDTH), (int) (k % FAULT_WIDTH),
+                (long) r.diverged, (unsigned long) r.output, (unsigned long) golden_output, effect[e]);
+    }
+    if (f != stdout) fclose(f);
+    fprintf(stderr, "%zu faults: %zu masked, %zu transient, %zu corrupt, %zu crash\n",
+            num_faults, count[0], count[1], count[2], count[3]);
+    munmap(results, std::max<size_t>(num_faults, 1) * sizeof(FaultResult));
+}
+#endif
 
 //----------------------------------------------------------------------------------------------------
 // Main testbench
@@ -12,6 +564,27 @@ int main(int argc, char** argv, char** env) {
 
     int trace_index = 0;
     bool is_random  = false;
+    const char* waveform_path = NULL;   // File, FIFO or "-" (stdout); default sim/waveform[_<i>].<ext>,
+                                        // sim/waveform_<class>_<i>.<ext> in a campaign
+    int num_traces  = 0;                // Campaign: traces per class, from trace_index on
+    bool classes[2] = {true, true};     // Campaign: fixed, random
+    int num_workers = 1;                // Worker threads (0: all cores)
+    int prefix      = 0;                // Shared cycles after the reset
+    const char* checkpoint = NULL;      // Save the prefix here and start every trace from it
+    int64_t fault_from = -1, fault_to = -1;     // Fault campaign: cycles to inject
+    int fault_jobs  = 0;                // Fault campaign: concurrent children (0: all cores)
+    const char* fault_out = NULL;       // Fault campaign: results table (default stdout)
+    std::vector<TraceWindow> windows = {{INIT_TIME_TRACES, END_TIME_TRACES}};   // Trace windows (cycles)
+    bool trigger_armed      = false;    // Windows count from the first TRIGGER_SIGNAL == trigger_value
+    uint64_t trigger_value  = 0;
+    bool seeded     = false;            // Campaign seed given (default: from the time and PID)
+    uint64_t seed   = 0;
+    bool shuffle    = false;            // Campaign: fixed and random traces in random order
+    const char* profile_out = NULL;     // Per-trace profile (SIM_PROFILE), .json or .csv
+    const char* stimulus_file = NULL;   // Inputs of the traces (genstim), mapped
+    std::string mmio        = "";       // Peripherals switched between the models and the RTL
+    std::string uart_input  = "";       // Read by the firmware from the UART model
+    const char* uart_out    = NULL;     // Printed by the firmware, appended (default stdout for a single trace)
 
     for (int i = 1; i < argc; i++) 
     {
@@ -37,6 +610,292 @@ int main(int argc, char** argv, char** env) {
         {
             is_random = true;
         }
+        else if (arg == "--waveform") 
+        {
+            if (i + 1 < argc) 
+            {
+                waveform_path = argv[++i];
+            } 
+            else 
+            {
+                std::cerr << "Error: --waveform requires a path" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--num_traces") 
+        {
+            if (i + 1 < argc) 
+            {
+                num_traces = std::atoi(argv[++i]);
+                if (num_traces <= 0) 
+                {
+                    std::cerr << "Error: num_traces must be a positive integer" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            } 
+            else 
+            {
+                std::cerr << "Error: --num_traces requires a value" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--classes") 
+        {
+            if (i + 1 < argc) 
+            {
+                std::string list = std::string(argv[++i]) + ",";
+                classes[0] = classes[1] = false;
+                for (size_t a = 0, b; (b = list.find(',', a)) != std::string::npos; a = b + 1) 
+                {
+                    std::string c = list.substr(a, b - a);
+                    if (c == "fixed") 
+                        classes[0] = true;
+                    else if (c == "random") 
+                        classes[1] = true;
+                    else 
+                    {
+                        std::cerr << "Error: Unknown class " << c << " (fixed, random)" << std::endl;
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            } 
+            else 
+            {
+                std::cerr << "Error: --classes requires a list" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--workers") 
+        {
+            if (i + 1 < argc) 
+            {
+                num_workers = std::atoi(argv[++i]);
+                if (num_workers < 0) 
+                {
+                    std::cerr << "Error: workers must be a non-negative integer" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            } 
+            else 
+            {
+                std::cerr << "Error: --workers requires a value" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--prefix") 
+        {
+            if (i + 1 < argc) 
+            {
+                prefix = std::atoi(argv[++i]);
+                if (prefix < 0) 
+                {
+                    std::cerr << "Error: prefix must be a non-negative integer" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            } 
+            else 
+            {
+                std::cerr << "Error: --prefix requires a value" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--checkpoint") 
+        {
+            if (i + 1 < argc) 
+            {
+                checkpoint = argv[++i];
+            } 
+            else 
+            {
+                std::cerr << "Error: --checkpoint requires a path" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            #if !defined(SIM_SAVABLE)
+                std::cerr << "Error: --checkpoint needs a simulator built with --savable (SIM_SAVABLE=1)" << std::endl;
+                exit(EXIT_FAILURE);
+            #endif
+        }
+        else if (arg == "--seed") 
+        {
+            char* end = NULL;
+            if (i + 1 < argc) 
+            {
+                seed = strtoull(argv[++i], &end, 0);
+            }
+            if (end == NULL || *end != '\0') 
+            {
+                std::cerr << "Error: --seed requires a value" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            seeded = true;
+        }
+        else if (arg == "--schedule") 
+        {
+            std::string order = i + 1 < argc ? argv[++i] : "";
+            if (order == "ordered") 
+                shuffle = false;
+            else if (order == "random") 
+                shuffle = true;
+            else 
+            {
+                std::cerr << "Error: --schedule requires ordered or random" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--stimulus") 
+        {
+            if (i + 1 < argc) 
+            {
+                stimulus_file = argv[++i];
+            } 
+            else 
+            {
+                std::cerr << "Error: --stimulus requires a path" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--mmio") 
+        {
+            // name=fast|rtl,... e.g. uart=fast,leds=rtl
+            MmioBus check;
+            mmio = i + 1 < argc ? argv[++i] : "";
+            if (mmio.empty() || !check.configure(mmio)) 
+            {
+                std::cerr << "Error: --mmio requires name=fast|rtl,... (uart, leds)" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--uart_input") 
+        {
+            if (i + 1 < argc) 
+            {
+                uart_input = unescape(argv[++i]);
+            } 
+            else 
+            {
+                std::cerr << "Error: --uart_input requires a string" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--uart_out") 
+        {
+            if (i + 1 < argc) 
+            {
+                uart_out = argv[++i];
+            } 
+            else 
+            {
+                std::cerr << "Error: --uart_out requires a path" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--profile") 
+        {
+            if (i + 1 < argc) 
+            {
+                profile_out = argv[++i];
+            } 
+            else 
+            {
+                std::cerr << "Error: --profile requires a path" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            #if !defined(SIM_PROFILE)
+                std::cerr << "Error: --profile needs a simulator built with SIM_PROFILE=1" << std::endl;
+                exit(EXIT_FAILURE);
+            #endif
+        }
+        else if (arg == "--windows") 
+        {
+            // start:stop,start:stop,... in cycles, sorted and not overlapping
+            const char* p = i + 1 < argc ? argv[++i] : "";
+            char* end = NULL;
+            windows.clear();
+            while (*p != '\0')
+            {
+                TraceWindow win;
+                win.start = strtoull(p, &end, 0);
+                win.stop  = *end == ':' ? strtoull(end + 1, &end, 0) : 0;
+                if (win.stop <= win.start || (*end != ',' && *end != '\0') ||
+                    (!windows.empty() && win.start < windows.back().stop)) 
+                {
+                    windows.clear();
+                    break;
+                }
+                windows.push_back(win);
+                p = *end == ',' ? end + 1 : end;
+            }
+            if (windows.empty()) 
+            {
+                std::cerr << "Error: --windows requires sorted, non-overlapping windows start:stop,... (cycles)" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--trigger") 
+        {
+            char* end = NULL;
+            if (i + 1 < argc) 
+            {
+                trigger_value = strtoull(argv[++i], &end, 0);
+            }
+            if (end == NULL || *end != '\0') 
+            {
+                std::cerr << "Error: --trigger requires a value" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            trigger_armed = true;
+            #if !defined(TRIGGER_SIGNAL)
+                std::cerr << "Error: --trigger needs a simulator built with TRIGGER_SIGNAL" << std::endl;
+                exit(EXIT_FAILURE);
+            #endif
+        }
+        else if (arg == "--faults") 
+        {
+            char* end = NULL;
+            if (i + 1 < argc) 
+            {
+                fault_from = strtoll(argv[++i], &end, 0);
+                fault_to   = *end == ':' ? strtoll(end + 1, &end, 0) : -1;
+            }
+            if (fault_from < 0 || fault_to < fault_from || *end != '\0') 
+            {
+                std::cerr << "Error: --faults requires a window from:to (cycles)" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            #if !defined(FAULT_SIGNAL)
+                std::cerr << "Error: --faults needs a simulator built with FAULT_SIGNAL (make faults)" << std::endl;
+                exit(EXIT_FAILURE);
+            #endif
+        }
+        else if (arg == "--fault_jobs") 
+        {
+            if (i + 1 < argc) 
+            {
+                fault_jobs = std::atoi(argv[++i]);
+                if (fault_jobs < 0) 
+                {
+                    std::cerr << "Error: fault_jobs must be a non-negative integer" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            } 
+            else 
+            {
+                std::cerr << "Error: --fault_jobs requires a value" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "--fault_out") 
+        {
+            if (i + 1 < argc) 
+            {
+                fault_out = argv[++i];
+            } 
+            else 
+            {
+                std::cerr << "Error: --fault_out requires a path" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
         else 
         {
             std::cerr << "Error: Unknown argument " << arg << std::endl;
@@ -48,81 +907,161 @@ int main(int argc, char** argv, char** env) {
     // Initial Configuration
     //------------------------------------------------------------------------------------------------
 
-    // Construct design object, and trace object
-	Vsim *dut       = new Vsim;         // Design Top Module
-    Vtrace *m_trace = new Vtrace;       // Trace
+    #if defined(FAULT_SIGNAL)
+        if (fault_from >= 0)
+        {
+            if (fault_jobs == 0)
+            {
+                fault_jobs = std::thread::hardware_concurrency();
+            }
+            run_faults(prefix, fault_from, fault_to, std::max(1, fault_jobs), fault_out, mmio, uart_input);
+            exit(EXIT_SUCCESS);
+        }
+    #else
+        (void) fault_out;
+    #endif
 
-    // Trace configuration
-    if (TRACE_SIGNALS)
+    if (!seeded)
     {
-        Verilated::traceEverOn(true);     			                // Turn on trace switch in context
-        dut->trace(m_trace, DEPTH_LEVELS);        		            // Set depth levels of the trace
-        
-        char waveform_file[256];
-        char index[32];
-        dec_2_char(trace_index, index);
-        
-        strcpy(waveform_file, "sim/waveform");
-        #if defined(WAVEFORM_TYPE_VCD)
-            strcat(waveform_file, "_");
-            strcat(waveform_file, (const char*) index);
-        #endif
-        strcat(waveform_file, (const char*) WAVEFORM_EXTENSION);
+        seed = random_key((uint64_t) time(NULL), (uint64_t) getpid());
+        std::cerr << "Seed: " << seed << " (--seed to repeat the run)" << std::endl;
+    }
 
-        m_trace->open((const char*) waveform_file); 		        // Open the Waveform file to store data
+    // Same order as one process per trace: fixed i, random i, fixed i+1, ...
+    Campaign c;
+    std::vector<Job>& jobs = c.jobs;
+    if (num_traces == 0)
+    {
+        jobs.push_back({trace_index, is_random});
+    }
+    else
+    {
+        for (int i = trace_index; i < trace_index + num_traces; i++)
+        {
+            for (int c = 0; c < 2; c++)
+            {
+                if (classes[c]) jobs.push_back({i, c == 1});
+            }
+        }
     }
 
+    // Records shorter than the Test Values read would be read past their end. Fixed records
+    // repeat; random traces without a record would silently fall back to verilog_random
+    StimulusFile stimulus;
+    if (stimulus_file)
+    {
+        if (!stimulus.open(stimulus_file))
+        {
+            exit(EXIT_FAILURE);
+        }
+        if (stimulus.words() < STIMULUS_WORDS)
+        {
+            std::cerr << "Error: " << stimulus_file << " has " << stimulus.words()
+                      << " words per record; the testbench reads " << STIMULUS_WORDS << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        int last = num_traces > 0 ? trace_index + num_traces - 1 : trace_index;
+        bool random = num_traces > 0 ? classes[1] : is_random;
+        if (random && stimulus.random() > 0 && last >= (int) stimulus.random())
+        {
+            std::cerr << "Error: " << stimulus_file << " has " << stimulus.random()
+                      << " random records; trace " << last << " needs one" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Randomized interleaving (TVLA): the class of each next trace is not predictable, so slow
+    // drifts of the setup cannot line up with it. Shuffled from a stream of its own of the seed.
+    if (shuffle)
+    {
+        SimContext order;
+        verilog_random_seed(order, random_key(seed, UINT64_MAX));
+        for (size_t i = jobs.size(); i > 1; i--)
+        {
+            std::swap(jobs[i - 1], jobs[verilog_random(order) % i]);
+        }
+    }
+
+    if (num_workers == 0)
+    {
+        num_workers = std::thread::hardware_concurrency();
+    }
+    num_workers = std::max(1, std::min(num_workers, (int) jobs.size()));
+
     //------------------------------------------------------------------------------------------------
-    // Test Values
+    // Simulation
     //------------------------------------------------------------------------------------------------
- 
-    Verilated::randSeed(verilog_random());
 
-    if (!is_random)
-    {
-        /* private_key[0] = 0x01dce7bc4bdadd91;
-        private_key[1] = 0x5bfd44842512d795;
-        private_key[2] = 0x6476155515f4b2f2;
-        private_key[3] = 0x69f592120fb60f46;
+    c.waveform_path = waveform_path;
+    c.num_traces    = num_traces > 0 ? trace_index + num_traces : 0;
+    c.seed          = seed;
+    c.stimulus      = stimulus_file ? &stimulus : NULL;
+    c.prefix        = prefix;
+    c.checkpoint    = checkpoint;
+    c.windows       = windows;
+    c.trigger_armed = trigger_armed;
+    c.trigger_value = trigger_value;
+    c.mmio          = mmio;
+    c.uart_input    = uart_input;
 
-        public_key[0] = 0x575D25B579CAD038; 
-        public_key[1] = 0x0AA0CC335924119A;
-        public_key[2] = 0x9C9B21B7FC74E4E7;
-        public_key[3] = 0x0A4AB26A652CA791; */
+    // UART output: appended to the file (one process per trace can share it), else to the terminal
+    // for a single trace (stderr if the waveform is on stdout)
+    if (uart_out)
+    {
+        c.uart_out   = std::string(uart_out) == "-" ? stdout : fopen(uart_out, "a");
+        c.uart_label = true;
+        if (c.uart_out == NULL)
+        {
+            perror(uart_out);
+            exit(EXIT_FAILURE);
+        }
     }
-    else
+    else if (num_traces == 0)
     {
-        /* private_key[0] = verilog_random();
-        private_key[1] = verilog_random();
-        private_key[2] = verilog_random();
-        private_key[3] = verilog_random();
-
-        public_key[0] = verilog_random(); 
-        public_key[1] = verilog_random();
-        public_key[2] = verilog_random();
-        public_key[3] = verilog_random(); */
+        c.uart_out = waveform_path && std::string(waveform_path) == "-" ? stderr : stdout;
     }
 
-    dut->rst_n = 0;
-    verilog_delay(10, dut, m_trace);
-    dut->rst_n = 1;
+    // The prefix is simulated once, before the workers start
+    #if defined(SIM_SAVABLE)
+        if (checkpoint)
+        {
+            save_checkpoint(checkpoint, c);
+        }
+    #endif
 
-    // Simulate until max simulation time is reached
-    while (sim_time <= 2*HALF_CYCLE*MAX_SIM_TIME) 
+    std::vector<Worker> workers(num_workers);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers[i].sim.id = i;
+        threads.emplace_back(run_worker, &workers[i], &c);
+    }
+    for (std::thread& t : threads)
+    {
+        t.join();
+    }
+    if (num_traces > 0)
     {
-        sim_step(dut, m_trace);
-        sim_step(dut, m_trace);
+        clear_progress_bar();
+    }
+
+    #if defined(SIM_PROFILE)
+        profile_summary(c.profile);
+        if (profile_out)
+        {
+            profile_write(profile_out, c.profile);
+        }
+    #else
+        (void) profile_out;
+    #endif
+    if (c.uart_out && c.uart_out != stdout && c.uart_out != stderr)
+    {
+        fclose(c.uart_out);
     }
 
     //------------------------------------------------------------------------------------------------
     // End Simulation
     //------------------------------------------------------------------------------------------------
 
-    // Remember to close the trace object to save data in the file
-    if (TRACE_SIGNALS) m_trace->close();
-
-    // Free memory
-    delete dut;
-    delete m_trace;
     exit(EXIT_SUCCESS);
 }
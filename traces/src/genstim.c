@@ -0,0 +1,230 @@
+//  genstim.c
+//  === Write a stimulus file (.stim) for the trace campaign of the testbench.
+//
+//  header  64 bytes: magic "HWSTM001", uint32 header size, record size,
+//          fixed records, random records, dtype "<u8", zero padding
+//  record  the inputs of one trace, in 64-bit words. the fixed records come
+//          first and repeat over the trace index; the random ones follow,
+//          one per trace index.
+//
+//  little-endian. the simulator maps the file and reads the record of each
+//  trace in place (--stimulus).
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define STIM_MAGIC  "HWSTM001"
+#define STIM_HDR_SZ 64
+#define FIXED_MAX   64          //  -f records
+#define LINE_MAX_SZ 0x10000
+
+//  SplitMix64, keyed as verilog_random() in sim_utils.cpp: random record i
+//  holds the numbers that random trace i would draw with the same seed
+
+static inline uint64_t splitmix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t random_key(uint64_t seed, uint64_t stream)
+{
+    return splitmix64(seed ^ splitmix64(stream + 0x9E3779B97F4A7C15ULL));
+}
+
+static inline void put32(uint8_t *p, uint32_t x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+static inline void put64(uint8_t *p, uint64_t x)
+{
+    put32(p, x);
+    put32(p + 4, x >> 32);
+}
+
+//  "w0,w1,..." or "w0 w1 ..." hex words into a record of n words;
+//  missing words are zero. returns the number of words read, -1 on error
+
+static int parse_words(const char *s, uint64_t *w, int n)
+{
+    char *e;
+    int k = 0;
+
+    memset(w, 0, n * sizeof(uint64_t));
+    while (*s != 0) {
+        while (*s == ' ' || *s == '\t' || *s == ',')
+            s++;
+        if (*s == 0 || *s == '\n' || *s == '\r')
+            break;
+        if (k >= n)
+            return -1;
+        w[k++] = strtoull(s, &e, 16);
+        if (e == s)
+            return -1;
+        s = e;
+    }
+
+    return k;
+}
+
+static int put_record(FILE *f, uint8_t *buf, const uint64_t *w, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        put64(buf + 8 * i, w[i]);
+    }
+    return fwrite(buf, 8, n, f) == (size_t) n ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    int         words = 8;          //  64-bit words per record
+    const char  *fixed[FIXED_MAX];  //  -f records
+    int         nfixed = 0;
+    int64_t     nrandom = 0;        //  generated random records
+    uint64_t    seed = 0;
+    const char  *known = NULL;      //  random records from a text file, first
+    const char  *out = NULL;
+
+    uint8_t     hdr[STIM_HDR_SZ], *buf;
+    uint64_t    *w;
+    char        line[LINE_MAX_SZ];
+    int64_t     nknown = 0, r;
+    FILE        *f, *k = NULL;
+    int         i, c;
+
+    while ((i = getopt(argc, argv, "w:f:n:S:k:o:")) != -1) {
+        switch (i) {
+            case 'w':
+                words = atoi(optarg);
+                break;
+            case 'f':
+                if (nfixed < FIXED_MAX)
+                    fixed[nfixed] = optarg;
+                nfixed++;
+                break;
+            case 'n':
+                nrandom = strtoll(optarg, NULL, 0);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'k':
+                known = optarg;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            default:
+                words = 0;
+                break;
+        }
+    }
+
+    if (words < 1 || nfixed > FIXED_MAX || nrandom < 0 || out == NULL || optind != argc) {
+        fprintf(stderr, "Usage: genstim [-w words] [-f w0,w1,...] [-k vectors.txt]"
+                        " [-n random] [-S seed] -o <out.stim>\n"
+                        "  -w  64-bit words per trace (default 8, as the testbench reads)\n"
+                        "  -f  a fixed record, in hex words; repeat for several,\n"
+                        "      used in turn by the fixed traces (up to %d)\n"
+                        "  -k  random records, one per line of hex words, e.g.\n"
+                        "      known-answer vectors ('#' starts a comment)\n"
+                        "  -n  random records drawn after them, the same numbers\n"
+                        "      as verilog_random() with --seed\n"
+                        "  -S  campaign seed (0)\n"
+                        "  -o  output file\n", FIXED_MAX);
+        return 1;
+    }
+
+    w = malloc(words * sizeof(uint64_t));
+    buf = malloc(words * 8);
+    if (w == NULL || buf == NULL)
+        exit(-1);
+
+    //  count the known vectors first: the header holds the totals
+    if (known != NULL) {
+        k = fopen(known, "r");
+        if (k == NULL) {
+            perror(known);
+            return 1;
+        }
+        while (fgets(line, sizeof(line), k) != NULL) {
+            if (line[0] != '#' && parse_words(line, w, words) > 0)
+                nknown++;
+        }
+        rewind(k);
+    }
+
+    f = fopen(out, "wb");
+    if (f == NULL) {
+        perror(out);
+        return 1;
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, STIM_MAGIC, 8);
+    put32(hdr + 8, STIM_HDR_SZ);
+    put32(hdr + 12, 8 * words);
+    put32(hdr + 16, nfixed);
+    put32(hdr + 20, nknown + nrandom);
+    memcpy(hdr + 24, "<u8", 4);
+    if (fwrite(hdr, sizeof(hdr), 1, f) != 1)
+        goto fail;
+
+    for (i = 0; i < nfixed; i++) {
+        if (parse_words(fixed[i], w, words) < 0) {
+            fprintf(stderr, "Bad fixed record '%s' (at most %d hex words)\n", fixed[i], words);
+            return 1;
+        }
+        if (put_record(f, buf, w, words) != 0)
+            goto fail;
+    }
+
+    if (k != NULL) {
+        while (fgets(line, sizeof(line), k) != NULL) {
+            if (line[0] == '#')
+                continue;
+            c = parse_words(line, w, words);
+            if (c < 0) {
+                fprintf(stderr, "%s: bad vector (at most %d hex words)\n", known, words);
+                return 1;
+            }
+            if (c > 0 && put_record(f, buf, w, words) != 0)
+                goto fail;
+        }
+        fclose(k);
+    }
+
+    //  random record r: what random trace r draws with this seed
+    for (r = nknown; r < nknown + nrandom; r++) {
+        uint64_t key = random_key(seed, ((uint64_t) r << 1) | 1);
+        for (i = 0; i < words; i++) {
+            w[i] = splitmix64(key + (uint64_t) (i + 1) * 0x9E3779B97F4A7C15ULL);
+        }
+        if (put_record(f, buf, w, words) != 0)
+            goto fail;
+    }
+
+    if (fclose(f) != 0) {
+        perror(out);
+        return 1;
+    }
+    free(w);
+    free(buf);
+
+    return 0;
+
+fail:
+    perror(out);
+    return 1;
+}
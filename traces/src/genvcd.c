@@ -0,0 +1,265 @@
+//  genvcd.c
+//  === Write a synthetic Verilator-style VCD file to benchmark readvcd.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define WIDTH_MAX   64          //  entries in the width distribution
+#define WIDTH_DEF   "1:60,2:5,4:5,8:10,16:5,32:10,64:3,128:1,256:1"
+#define OUT_BUF     0x100000
+
+//  xorshift64*; the same seed gives the same file
+
+static uint64_t rng_state = 1;
+
+static inline uint64_t rng_next()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+//  uniform in [0, 1)
+
+static inline double rng_unif()
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+//  bijective base-94 identifier of code x, as written by verilator
+
+static void vcd_id(char *id, uint64_t x)
+{
+    int i;
+
+    id[0] = '!' + x % 94;
+    x /= 94;
+    for (i = 1; x > 0; i++) {
+        x--;
+        id[i] = '!' + x % 94;
+        x /= 94;
+    }
+    id[i] = 0;
+}
+
+//  "w:weight,..." bus width distribution
+
+static int width_parse(char *s, int *w, double *p)
+{
+    char *t, *e;
+    double sum = 0.0;
+    int n = 0, i;
+
+    for (t = strtok(s, ","); t != NULL; t = strtok(NULL, ",")) {
+        if (n >= WIDTH_MAX)
+            return -1;
+        w[n] = strtol(t, &e, 0);
+        p[n] = *e == ':' ? strtod(e + 1, &e) : 1.0;
+        if (*e != 0 || w[n] < 1 || p[n] < 0.0)
+            return -1;
+        sum += p[n];
+        n++;
+    }
+    if (n == 0 || sum <= 0.0)
+        return -1;
+
+    //  cumulative
+    for (i = 0; i < n; i++) {
+        p[i] = (i > 0 ? p[i - 1] : 0.0) + p[i] / sum;
+    }
+
+    return n;
+}
+
+//  random value of a w-bit vector, written at full width like verilator
+
+static void put_vector(FILE *f, char *buf, int w, const char *id)
+{
+    uint64_t x = 0;
+    int i;
+
+    buf[0] = 'b';
+    for (i = 0; i < w; i++) {
+        if (i % 64 == 0)
+            x = rng_next();
+        buf[i + 1] = '0' + (x & 1);
+        x >>= 1;
+    }
+    buf[w + 1] = ' ';
+    buf[w + 2] = 0;
+    fputs(buf, f);
+    fputs(id, f);
+    fputc('\n', f);
+}
+
+int main(int argc, char **argv)
+{
+    int     nsig = 1000;        //  signals
+    int64_t ncyc = 1000;        //  clock cycles
+    int     id_len = 1;         //  minimum identifier length
+    double  act = 0.1;          //  activity factor
+    int     nscope = 0;         //  modules (0: one per 50 signals)
+    char    wdef[] = WIDTH_DEF;
+    char    *wlist = wdef;
+    const char *out = NULL;
+
+    int     wn, w[WIDTH_MAX];
+    double  wp[WIDTH_MAX];
+    int     *sw;                //  width of each signal
+    char    (*sid)[16];         //  identifier of each signal
+    uint8_t *bit;               //  value of 1-bit signals
+    char    *buf, clk_id[16];
+    uint64_t code;
+    int64_t c;
+    double  u;
+    FILE    *f;
+    int     i, k, wmax;
+
+    while ((i = getopt(argc, argv, "n:c:w:i:a:m:S:o:")) != -1) {
+        switch (i) {
+            case 'n':
+                nsig = atoi(optarg);
+                break;
+            case 'c':
+                ncyc = strtoll(optarg, NULL, 0);
+                break;
+            case 'w':
+                wlist = optarg;
+                break;
+            case 'i':
+                id_len = atoi(optarg);
+                break;
+            case 'a':
+                act = strtod(optarg, NULL);
+                break;
+            case 'm':
+                nscope = atoi(optarg);
+                break;
+            case 'S':
+                rng_state = strtoull(optarg, NULL, 0) * 0x9E3779B97F4A7C15ULL + 1;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            default:
+                nsig = 0;
+                break;
+        }
+    }
+
+    wn = width_parse(wlist, w, wp);
+    if (nsig < 1 || ncyc < 1 || id_len < 1 || id_len > 8 || wn < 0 ||
+        act < 0.0 || act > 1.0 || optind != argc) {
+        fprintf(stderr, "Usage: genvcd [-n signals] [-c cycles] [-w width:weight,...]"
+                        " [-i id length] [-a activity] [-m modules] [-S seed] [-o out.vcd]\n"
+                        "  -n  number of signals besides the clock (default 1000)\n"
+                        "  -c  clock cycles; changes come at the rising edges (1000)\n"
+                        "  -w  bus width distribution (default %s)\n"
+                        "  -i  minimum identifier length (1); long codes are too\n"
+                        "      sparse for the direct index of readvcd and take\n"
+                        "      its hash table instead\n"
+                        "  -a  probability that a signal changes in a cycle (0.1)\n"
+                        "  -m  number of modules the signals are spread over\n"
+                        "      (default: one per 50 signals)\n"
+                        "  -S  random seed\n"
+                        "  -o  output file (default stdout)\n", WIDTH_DEF);
+        return 1;
+    }
+    if (nscope < 1)
+        nscope = (nsig + 49) / 50;
+
+    f = out == NULL ? stdout : fopen(out, "w");
+    if (f == NULL) {
+        perror(out);
+        return 1;
+    }
+    setvbuf(f, NULL, _IOFBF, OUT_BUF);
+
+    sw = malloc(nsig * sizeof(int));
+    sid = malloc(nsig * sizeof(*sid));
+    bit = calloc(nsig, 1);
+    if (sw == NULL || sid == NULL || bit == NULL)
+        exit(-1);
+
+    //  first code with id_len digits
+    code = 0;
+    for (i = 1, c = 94; i < id_len; i++, c *= 94) {
+        code += c;
+    }
+    vcd_id(clk_id, code++);
+
+    //  preamble: TOP.clk and nscope modules of signals
+    fprintf(f, "$version Generated by genvcd $end\n"
+                "$timescale 100ps $end\n\n"
+                " $scope module TOP $end\n"
+                "  $var wire  1 %s clk $end\n", clk_id);
+    wmax = 1;
+    for (k = 0, i = 0; k < nscope; k++) {
+        fprintf(f, "  $scope module m%d $end\n", k);
+        for (; i < (int64_t) nsig * (k + 1) / nscope; i++) {
+            u = rng_unif();
+            sw[i] = w[wn - 1];
+            for (c = 0; c < wn; c++) {
+                if (u < wp[c]) {
+                    sw[i] = w[c];
+                    break;
+                }
+            }
+            if (sw[i] > wmax)
+                wmax = sw[i];
+            vcd_id(sid[i], code++);
+            if (sw[i] == 1)
+                fprintf(f, "   $var wire  1 %s s%d $end\n", sid[i], i);
+            else
+                fprintf(f, "   $var wire %2d %s s%d [%d:0] $end\n",
+                        sw[i], sid[i], i, sw[i] - 1);
+        }
+        fprintf(f, "  $upscope $end\n");
+    }
+    fprintf(f, " $upscope $end\n$enddefinitions $end\n\n\n");
+
+    buf = malloc(wmax + 3);
+    if (buf == NULL)
+        exit(-1);
+
+    //  initial values
+    fprintf(f, "#0\n0%s\n", clk_id);
+    for (i = 0; i < nsig; i++) {
+        if (sw[i] == 1) {
+            bit[i] = rng_next() >> 63;
+            fprintf(f, "%c%s\n", '0' + bit[i], sid[i]);
+        } else {
+            put_vector(f, buf, sw[i], sid[i]);
+        }
+    }
+
+    //  half a cycle is 5 time units, as in the simulator
+    for (c = 0; c < ncyc; c++) {
+        fprintf(f, "#%ld\n1%s\n", 10 * c + 5, clk_id);
+        for (i = 0; i < nsig; i++) {
+            if (rng_unif() >= act)
+                continue;
+            if (sw[i] == 1) {
+                bit[i] ^= 1;
+                fprintf(f, "%c%s\n", '0' + bit[i], sid[i]);
+            } else {
+                put_vector(f, buf, sw[i], sid[i]);
+            }
+        }
+        fprintf(f, "#%ld\n0%s\n", 10 * c + 10, clk_id);
+    }
+
+    free(sw);
+    free(sid);
+    free(bit);
+    free(buf);
+    if (f != stdout)
+        fclose(f);
+
+    return 0;
+}
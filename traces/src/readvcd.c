@@ -6,199 +6,1658 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include "trs.h"
+#ifdef READVCD_FST
+#include "fstapi.h"
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACK_X86
+#endif
 
-#define LINE_SZ_MAX 1024
 #define TOKEN_MAX   16
-#define ID_SZ_MAX   8
-#define SCOPE_MAX   100
+#define FILTER_MAX  32
 
 typedef struct {
-    char id[ID_SZ_MAX];     //  identifier
+    const char *id;         //  identifier (in the name pool)
     int d;                  //  width
     int n;                  //  how many signal names
     size_t o;               //  first signal name
-    size_t u;               //  how many times updated
-    char *s;                //  pointer to state
+    size_t s;               //  offset of state
+    int w;                  //  bytes of packed state
+    int sc;                 //  scope id
+    bool reg;               //  declared as a register
+    bool on;                //  passes the scope filters (else no state)
 } var_t;
 
-char *signame = NULL;       //  buffer for signal names
-size_t signame_sz = 0;      //  size
-size_t signame_max = 0;     //  allocated
+//  scope tree: each scope is stored once, as its own name below a parent
+//  node. node 0 is the root and has no name.
+typedef struct {
+    uint32_t up;            //  parent node
+    uint32_t len;           //  length of the name
+    size_t nam;             //  name, offset in the name pool
+} scope_node_t;
+
+//  one $var: identifier and leaf name in the name pool, and its scope
+typedef struct {
+    size_t id;              //  identifier, offset in the name pool
+    size_t nam;             //  leaf name, offset in the name pool
+    uint32_t sc;            //  scope node
+    int d;                  //  width
+    bool reg;               //  declared as a register
+} decl_t;
+
+//  parsed preamble. files with identical signal definitions share one
+//  header through the header cache (batch mode).
+typedef struct vcd_hdr_s {
+    struct vcd_hdr_s *next; //  next in cache
+    uint64_t fp;            //  fingerprint of the definitions
+
+    char *pool;             //  zero-terminated identifiers and names
+    size_t pool_sz;         //  size
+    size_t pool_max;        //  allocated
+
+    scope_node_t *node;     //  scope tree
+    size_t node_n;
+    size_t node_max;
+    uint32_t *node_tab;     //  (parent, name) -> node + 1 while parsing
+    size_t node_tab_n;      //  table size, a power of 2
+
+    decl_t *decl;           //  declarations in file order
+    size_t decl_n;
+    size_t decl_max;
+    size_t *ord;            //  declarations sorted by identifier and name
+
+    var_t *var;             //  signal variables
+    size_t var_n;
+
+    int max_dim;            //  largest signal width
+    size_t st_sz;           //  total number of state bytes
+
+    uint32_t *id_tab;       //  identifier index
+    size_t id_tab_n;        //  table size, a power of 2 when hashing
+    bool id_direct;         //  table indexed by verilator code
+
+    char **scope;           //  scope names by scope id
+    int scope_n;
+} vcd_hdr_t;
+
+// Structure to hold toggle data point
+typedef struct {
+    uint32_t count;
+    uint32_t time_step;
+} toggle_data_point_t;
+
+//  scopes x cycles matrix: the distance of every data point split by the
+//  scope of each signal, one row of scope_n counts per point
+typedef struct {
+    const vcd_hdr_t *h;     //  header with the scope names
+    int64_t *row;           //  running distance per scope
+    uint32_t *data;         //  rows
+    size_t n;               //  number of rows
+    size_t cap;             //  allocated rows
+} scope_mat_t;
+
+//  additional power models, each filling its own stream with one value
+//  per data point of the hamming distance trace
+
+enum { PM_HW = 1, PM_WHD, PM_REG };
+#define PM_MAX  8
+
+typedef struct {
+    int kind;               //  PM_*
+    const char *name;       //  output suffix
+    const char *arg;        //  weight file (whd)
+} pm_def_t;
+
+typedef struct {
+    int n;                  //  number of models
+    const pm_def_t *def;    //  model definitions
+    int64_t *wt[PM_MAX];    //  per-variable weight (whd, reg)
+    int64_t acc[PM_MAX];    //  running values
+    uint32_t *data[PM_MAX]; //  streams
+    size_t len;             //  points in each stream
+    size_t cap;             //  allocated points
+} pm_run_t;
+
+//  input source: a read-only mapping of the whole file, or a stream
+//  (pipes, fifos, stdin) read in blocks into a growing buffer
+
+#define STREAM_BLK  0x100000
+
+typedef struct {
+    int fd;                 //  file descriptor
+    const char *map;        //  mapped file or NULL
+    size_t map_sz;          //  size of mapping
+    size_t pos;             //  read position in mapping or block
+    char *blk;              //  stream block buffer
+    size_t blk_n;           //  bytes in block buffer
+    size_t blk_max;         //  size of block buffer
+    bool eof;               //  no more reads from the stream
+    uint64_t bytes;         //  bytes consumed from the stream
+} vcd_in_t;
+
+const char *kernel = NULL;  //  distance kernel in use
+bool verbose = false;       //  report parse statistics
+bool no_mmap = false;       //  always use the stream path
+int body_thr = 1;           //  worker threads for the value changes
+bool scope_out = false;     //  write the scopes x cycles matrix
+pm_def_t pm_def[PM_MAX];    //  additional power models
+int pm_n = 0;
+int64_t win_lo = 0;         //  first cycle of the window
+int64_t win_hi = INT64_MAX; //  first cycle after the window
+int64_t gap_step = 0;       //  dump step; a longer time jump ends a window
+const char *json_fn = NULL; //  benchmark records
+const char *flt_inc[FILTER_MAX];    //  include / exclude name patterns
+const char *flt_exc[FILTER_MAX];
+int flt_inc_n = 0, flt_exc_n = 0;
+trs_meta_t trs_meta;        //  metadata of single-file records
+uint32_t trs_samples = 0;   //  samples per record of a new set (0: first trace)
+
+vcd_hdr_t *hdr_cache = NULL;    //  headers seen so far
+pthread_mutex_t hdr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//  identifier index. verilator writes identifiers as a bijective base-94
+//  number of printable characters, least significant digit first, so the
+//  code is used directly as an array index. identifiers of other writers
+//  go to an open-addressing hash table. slots hold var index + 1.
+
+#define ID_CODE_NONE    -1
+#define ID_CODE_DIGITS  9       //  longer codes do not fit in 63 bits
+#define ID_DIRECT_SLACK 1024
+
+static inline int64_t id_code(const char *id, size_t l)
+{
+    int64_t x, m;
+    size_t i;
+
+    if (l == 0 || l > ID_CODE_DIGITS || id[0] < '!' || id[0] > '~')
+        return ID_CODE_NONE;
+    x = id[0] - '!';
+    m = 94;
+    for (i = 1; i < l; i++) {
+        if (id[i] < '!' || id[i] > '~')
+            return ID_CODE_NONE;
+        x += m * (id[i] - '!' + 1);
+        m *= 94;
+    }
+    return x;
+}
+
+static inline uint64_t fnv_add(uint64_t h, const void *p, size_t l)
+{
+    const uint8_t *s = (const uint8_t *) p;
+
+    while (l-- > 0) {
+        h = (h ^ *s++) * 0x100000001B3llu;
+    }
+    return h;
+}
+
+static inline size_t id_fnv(const char *id, size_t l)
+{
+    uint64_t h;
+
+    h = fnv_add(0xCBF29CE484222325llu, id, l);
+    return (size_t) (h ^ (h >> 32));
+}
+
+//  identifier of l characters; the change lines are not copied
+
+static var_t *find_id(const vcd_hdr_t *h, const char *id, size_t l)
+{
+    int64_t x;
+    size_t i, k;
+
+    if (h->id_direct) {
+        x = id_code(id, l);
+        if (x < 0 || (size_t) x >= h->id_tab_n || h->id_tab[x] == 0)
+            return NULL;
+        return &h->var[h->id_tab[x] - 1];
+    }
+
+    for (i = id_fnv(id, l); ; i++) {
+        k = h->id_tab[i & (h->id_tab_n - 1)];
+        if (k == 0)
+            return NULL;
+        if (strncmp(h->var[k - 1].id, id, l) == 0 && h->var[k - 1].id[l] == 0)
+            return &h->var[k - 1];
+    }
+}
+
+//  build the identifier index over var[]
+
+static void build_id_index(vcd_hdr_t *h)
+{
+    int64_t x, x_max;
+    size_t i, j, l;
+
+    x_max = 0;
+    for (i = 0; i < h->var_n; i++) {
+        x = id_code(h->var[i].id, strlen(h->var[i].id));
+        if (x < 0 || (size_t) x > 8 * h->var_n + ID_DIRECT_SLACK) {
+            x_max = ID_CODE_NONE;
+            break;
+        }
+        if (x > x_max)
+            x_max = x;
+    }
+
+    h->id_direct = (x_max >= 0);
+    if (h->id_direct) {
+        h->id_tab_n = x_max + 1;
+    } else {
+        h->id_tab_n = 16;
+        while (h->id_tab_n < 2 * h->var_n)
+            h->id_tab_n <<= 1;
+    }
+    h->id_tab = calloc(h->id_tab_n, sizeof(uint32_t));
+    if (h->id_tab == NULL)
+        exit(-1);
+
+    for (i = 0; i < h->var_n; i++) {
+        l = strlen(h->var[i].id);
+        if (h->id_direct) {
+            h->id_tab[id_code(h->var[i].id, l)] = i + 1;
+        } else {
+            for (j = id_fnv(h->var[i].id, l);
+                    h->id_tab[j & (h->id_tab_n - 1)] != 0; j++)
+                ;
+            h->id_tab[j & (h->id_tab_n - 1)] = i + 1;
+        }
+    }
+}
+
+//  open input ("-" is stdin); map regular files, stream anything else
+
+static int vcd_open(vcd_in_t *in, const char *fn)
+{
+    struct stat st;
+    void *p;
+
+    memset(in, 0, sizeof(vcd_in_t));
+    in->fd = strcmp(fn, "-") == 0 ? STDIN_FILENO : open(fn, O_RDONLY);
+    if (in->fd < 0)
+        return -1;
+
+    if (no_mmap || fstat(in->fd, &st) != 0 ||
+        !S_ISREG(st.st_mode) || st.st_size <= 0)
+        goto stream;
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+    if (p == MAP_FAILED)
+        goto stream;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    in->map = p;
+    in->map_sz = st.st_size;
+
+    return 0;
+
+stream:
+    in->blk_max = STREAM_BLK;
+    in->blk = malloc(in->blk_max);
+    if (in->blk == NULL)
+        exit(-1);
+
+    return 0;
+}
+
+static void vcd_close(vcd_in_t *in)
+{
+    if (in->map != NULL)
+        munmap((void *) in->map, in->map_sz);
+    if (in->fd > STDIN_FILENO)
+        close(in->fd);
+    free(in->blk);
+    memset(in, 0, sizeof(vcd_in_t));
+}
+
+//  next line, not copied and not terminated; length excludes the newline.
+//  a streamed line stays valid until the next call. returns NULL at end
+//  of file.
+
+static const char *vcd_line(vcd_in_t *in, size_t *len)
+{
+    const char *p, *q;
+    size_t l, scan;
+    ssize_t r;
+
+    if (in->map != NULL) {
+        if (in->pos >= in->map_sz)
+            return NULL;
+        p = in->map + in->pos;
+        q = memchr(p, '\n', in->map_sz - in->pos);
+        l = q != NULL ? (size_t) (q - p) : in->map_sz - in->pos;
+        in->pos += l + 1;
+        *len = l;
+        return p;
+    }
+
+    scan = in->pos;
+    for (;;) {
+        p = in->blk + in->pos;
+        q = memchr(in->blk + scan, '\n', in->blk_n - scan);
+        if (q != NULL) {
+            l = q - p;
+            in->pos += l + 1;
+            in->bytes += l + 1;
+            *len = l;
+            return p;
+        }
+        if (in->eof) {
+            if (in->pos >= in->blk_n)
+                return NULL;
+            l = in->blk_n - in->pos;
+            in->pos = in->blk_n;
+            in->bytes += l;
+            *len = l;
+            return p;
+        }
+
+        //  keep the partial line, grow the buffer if it is all one line
+        l = in->blk_n - in->pos;
+        memmove(in->blk, p, l);
+        in->blk_n = l;
+        in->pos = 0;
+        scan = l;
+        if (in->blk_n == in->blk_max) {
+            in->blk_max <<= 1;
+            in->blk = realloc(in->blk, in->blk_max);
+            if (in->blk == NULL)
+                exit(-1);
+        }
+
+        do {
+            r = read(in->fd, in->blk + in->blk_n, in->blk_max - in->blk_n);
+        } while (r < 0 && errno == EINTR);
+        if (r <= 0)
+            in->eof = true;
+        else
+            in->blk_n += r;
+    }
+}
+
+static uint64_t vcd_bytes(const vcd_in_t *in)
+{
+    if (in->map != NULL)
+        return in->pos < in->map_sz ? in->pos : in->map_sz;
+    return in->bytes;
+}
+
+//  read a decimal time stamp of at most len characters
+
+static int64_t dec_to_int(const char *s, size_t len)
+{
+    size_t i;
+    int64_t x;
+
+    x = 0;
+    for (i = 0; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+        x = (10 * x) + (s[i] - '0');
+    }
+
+    return x;
+}
+
+static double wall_time()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1E-9 * (double) ts.tv_nsec;
+}
+
+//  benchmark record of one parsed file, appended to json_fn as a line of
+//  JSON. lines are value changes for FST; the peak RSS is the process's.
+
+typedef struct {
+    const char *fn;             //  input file
+    const char *fmt;            //  "vcd" or "fst"
+    const char *input;          //  "mmap", "stream" or "fst"
+    int     thr;                //  body threads
+    bool    direct;             //  direct identifier index
+    bool    hdr_hit;            //  header came from the cache
+    uint64_t bytes;             //  bytes read
+    uint64_t hdr_bytes;         //  of which preamble
+    uint64_t lines;             //  lines (changes) parsed
+    uint32_t points;            //  data points produced
+    double  t0, t1, t2;         //  start, header done, body done
+} parse_stats_t;
+
+static pthread_mutex_t json_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void json_str(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s != 0; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((uint8_t) *s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void stats_json(const parse_stats_t *st)
+{
+    struct rusage ru;
+    double body;
+    FILE *f;
+
+    body = st->t2 - st->t1 > 0 ? st->t2 - st->t1 : 1E-9;
+    getrusage(RUSAGE_SELF, &ru);
+
+    pthread_mutex_lock(&json_lock);
+    f = fopen(json_fn, "a");
+    if (f == NULL) {
+        perror(json_fn);
+        pthread_mutex_unlock(&json_lock);
+        return;
+    }
+    fprintf(f, "{\"file\": ");
+    json_str(f, st->fn);
+    fprintf(f, ", \"format\": \"%s\", \"input\": \"%s\", \"threads\": %d, "
+            "\"kernel\": \"%s\", \"ids\": \"%s\", \"cached_header\": %s, "
+            "\"bytes\": %lu, \"header_bytes\": %lu, \"lines\": %lu, "
+            "\"points\": %u, \"header_s\": %.6f, \"body_s\": %.6f, "
+            "\"total_s\": %.6f, \"mb_per_s\": %.1f, \"lines_per_s\": %.0f, "
+            "\"peak_rss_kb\": %ld}\n",
+            st->fmt, st->input, st->thr, kernel,
+            st->direct ? "direct" : "hashed", st->hdr_hit ? "true" : "false",
+            st->bytes, st->hdr_bytes, st->lines, st->points,
+            st->t1 - st->t0, st->t2 - st->t1, st->t2 - st->t0,
+            1E-6 * (st->bytes - st->hdr_bytes) / body, st->lines / body,
+            ru.ru_maxrss);
+    fclose(f);
+    pthread_mutex_unlock(&json_lock);
+}
+
+//  signal state is packed with two bits per signal bit, lsb first:
+//  0 = '0', 1 = '1', 2 = 'x', 3 = 'z'. a w-bit variable takes
+//  (2 * w + 7) / 8 bytes and unused high bits are always zero.
+
+#define PACK_BYTES(d) ((2 * (size_t) (d) + 7) / 8)
+#define PACK_EVEN   0x5555555555555555llu
+
+static uint8_t pack_code[256];      //  character -> code, 0xFF invalid
+
+static void pack_init()
+{
+    memset(pack_code, 0xFF, sizeof(pack_code));
+    pack_code['0'] = 0;
+    pack_code['1'] = 1;
+    pack_code['x'] = 2;
+    pack_code['X'] = 2;
+    pack_code['z'] = 3;
+    pack_code['Z'] = 3;
+}
+
+//  pack a literal of l <= d characters (msb first) into d codes; shorter
+//  literals are extended to the left with 0, or with x / z if the
+//  leftmost character is x / z
+
+//  eight characters at once: '0' 0x30, '1' 0x31, 'x' 0x78, 'z' 0x7A;
+//  value bit is bit 0 (or bit 1 with bit 6), x/z flag is bit 6
+
+static inline uint64_t pack_char8(const char *s)
+{
+    uint64_t w, c;
+
+    memcpy(&w, s, 8);
+    w = __builtin_bswap64(w);
+    c = (w & 0x0101010101010101llu) |
+        ((w >> 1) & (w >> 6) & 0x0101010101010101llu) |
+        ((w >> 5) & 0x0202020202020202llu);
+    c = (c | (c >> 6)) & 0x000F000F000F000Fllu;
+    c = (c | (c >> 12)) & 0x000000FF000000FFllu;
+    return (c | (c >> 24)) & 0xFFFF;
+}
+
+static inline void pack_bits(uint8_t *p, const char *s, size_t l, int d)
+{
+    const char *e = s + l;
+    size_t i, k, n, w;
+    uint64_t x;
+    uint8_t c;
+
+    n = PACK_BYTES(d);
+    for (i = 0; i < l; i += 32) {
+        x = 0;
+        for (k = 0; k + 8 <= 32 && i + k + 8 <= l; k += 8) {
+            e -= 8;
+            x |= pack_char8(e) << (2 * k);
+        }
+        for (; k < 32 && i + k < l; k++) {
+            x |= (uint64_t) pack_code[(uint8_t) *--e] << (2 * k);
+        }
+        w = n - i / 4 < 8 ? n - i / 4 : 8;
+        memcpy(p + i / 4, &x, w);
+    }
+    i = (l + 3) / 4;
+    if (i < n)
+        memset(p + i, 0, n - i);
+
+    c = pack_code[(uint8_t) s[0]];
+    if (c >= 2) {
+        for (i = l; i < (size_t) d; i++) {
+            p[i / 4] |= c << (2 * (i % 4));
+        }
+    }
+}
+
+//  all-x state of d bits
+
+static void pack_x(uint8_t *p, int d)
+{
+    size_t n;
+
+    n = PACK_BYTES(d);
+    memset(p, 0xAA, n);
+    if (d % 4 != 0)
+        p[n - 1] &= (1 << (2 * (d % 4))) - 1;
+}
+
+//  value of a packed binary number; -1 if it has x or z bits
+
+static int64_t pack_to_int(const uint8_t *p, int d)
+{
+    int64_t x;
+    int i, c;
+
+    x = 0;
+    for (i = 0; i < d; i++) {
+        c = (p[i / 4] >> (2 * (i % 4))) & 3;
+        if (c > 1)
+            return -1;
+        if (i < 64)
+            x |= (int64_t) c << i;
+    }
+
+    return x;
+}
+
+//  hamming weight: number of '1' codes in n bytes of packed state
+
+static int64_t pack_weight(const uint8_t *p, size_t n)
+{
+    uint64_t x;
+    int64_t w;
+    size_t i;
+
+    w = 0;
+    for (i = 0; i < n; i += 8) {
+        x = 0;
+        memcpy(&x, p + i, n - i < 8 ? n - i : 8);
+        w += __builtin_popcountll(x & ~(x >> 1) & PACK_EVEN);
+    }
+    return w;
+}
+
+//  hamming distance kernels: number of two-bit codes that differ in
+//  n bytes of packed state
+
+static inline int64_t pack_dist_word(uint64_t x)
+{
+    return __builtin_popcountll((x | (x >> 1)) & PACK_EVEN);
+}
+
+static int64_t pack_dist_scalar(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    uint64_t x, y;
+    int64_t sd;
+    size_t i;
+
+    sd = 0;
+    for (i = 0; i + 8 <= n; i += 8) {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        sd += pack_dist_word(x ^ y);
+    }
+    if (i < n) {
+        x = 0;
+        y = 0;
+        memcpy(&x, a + i, n - i);
+        memcpy(&y, b + i, n - i);
+        sd += pack_dist_word(x ^ y);
+    }
+    return sd;
+}
+
+#ifdef PACK_X86
+
+//  sse2: or the pair bits together, then a bytewise popcount and psadbw
+
+static int64_t pack_dist_sse2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    const __m128i m1 = _mm_set1_epi8(0x55);
+    const __m128i m2 = _mm_set1_epi8(0x33);
+    const __m128i m4 = _mm_set1_epi8(0x0F);
+    __m128i x, acc;
+    uint64_t t[2];
+    size_t i;
+
+    acc = _mm_setzero_si128();
+    for (i = 0; i + 16 <= n; i += 16) {
+        x = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + i)),
+                            _mm_loadu_si128((const __m128i *) (b + i)));
+        x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi64(x, 1)), m1);
+        x = _mm_add_epi8(_mm_and_si128(x, m2),
+                            _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+        x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi64(x, 4)), m4);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, _mm_setzero_si128()));
+    }
+    _mm_storeu_si128((__m128i *) t, acc);
+
+    return (int64_t) (t[0] + t[1]) + pack_dist_scalar(a + i, b + i, n - i);
+}
+
+//  avx2: same with 256-bit vectors and a nibble lookup for the popcount
+
+__attribute__((target("avx2")))
+static int64_t pack_dist_avx2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    const __m256i m1 = _mm256_set1_epi8(0x55);
+    const __m256i m4 = _mm256_set1_epi8(0x0F);
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                        1, 2, 2, 3, 2, 3, 3, 4,
+                                        0, 1, 1, 2, 1, 2, 2, 3,
+                                        1, 2, 2, 3, 2, 3, 3, 4);
+    __m256i x, acc;
+    uint64_t t[4];
+    size_t i;
+
+    acc = _mm256_setzero_si256();
+    for (i = 0; i + 32 <= n; i += 32) {
+        x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)),
+                                _mm256_loadu_si256((const __m256i *) (b + i)));
+        x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, 1)), m1);
+        x = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, m4)),
+                _mm256_shuffle_epi8(lut,
+                    _mm256_and_si256(_mm256_srli_epi64(x, 4), m4)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(x, _mm256_setzero_si256()));
+    }
+    _mm256_storeu_si256((__m256i *) t, acc);
+
+    return (int64_t) (t[0] + t[1] + t[2] + t[3]) +
+            pack_dist_scalar(a + i, b + i, n - i);
+}
+
+#endif
+
+//  kernel for wide variables, picked at run time
+int64_t (*pack_dist_wide)(const uint8_t *, const uint8_t *, size_t) =
+    pack_dist_scalar;
+
+//  select the best supported kernel up to the named one (NULL: any)
+
+static const char *pack_select(const char *max)
+{
+    pack_dist_wide = pack_dist_scalar;
+    if (max != NULL && strcmp(max, "scalar") == 0)
+        return "scalar";
+#ifdef PACK_X86
+    __builtin_cpu_init();
+    if ((max == NULL || strcmp(max, "avx2") == 0) &&
+        __builtin_cpu_supports("avx2")) {
+        pack_dist_wide = pack_dist_avx2;
+        return "avx2";
+    }
+    pack_dist_wide = pack_dist_sse2;
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+//  names are assembled from the scope tree on demand, into a buffer that
+//  grows as needed and is owned by the caller
+
+typedef struct {
+    char *s;
+    size_t max;
+} name_buf_t;
+
+//  "TOP.core" of scope node sc or, with a leaf, "TOP.core.leaf"
+
+static char *scope_name(const vcd_hdr_t *h, uint32_t sc, const char *leaf,
+                        name_buf_t *b)
+{
+    size_t k, l, n;
+    uint32_t i;
+    bool sep;
+
+    l = leaf != NULL ? strlen(leaf) : 0;
+    k = l;
+    n = 0;
+    for (i = sc; i != 0; i = h->node[i].up) {
+        k += h->node[i].len + 1;
+        n++;
+    }
+    if (leaf == NULL && n > 0)
+        k--;
+
+    if (k + 1 > b->max) {
+        b->max = 2 * (k + 1);
+        b->s = realloc(b->s, b->max);
+        if (b->s == NULL)
+            exit(-1);
+    }
+    b->s[k] = 0;
+    k -= l;
+    if (l > 0)
+        memcpy(b->s + k, leaf, l);
+    sep = leaf != NULL;
+    for (i = sc; i != 0; i = h->node[i].up) {
+        if (sep)
+            b->s[--k] = '.';
+        sep = true;
+        k -= h->node[i].len;
+        memcpy(b->s + k, h->pool + h->node[i].nam, h->node[i].len);
+    }
+
+    return b->s;
+}
+
+//  full name of the k-th declaration in sorted order
+
+static char *name_at(const vcd_hdr_t *h, size_t k, name_buf_t *b)
+{
+    const decl_t *e = &h->decl[h->ord[k]];
+
+    return scope_name(h, e->sc, h->pool + e->nam, b);
+}
+
+char *get_signame(const vcd_hdr_t *h, const var_t *v, name_buf_t *b)
+{
+    return name_at(h, v->o, b);
+}
+
+//  split a value change line into *dim bits of data at *bits and the
+//  identifier, which is returned with its length in *id_sz. NULL if
+//  the line is malformed.
+
+static inline const char *change_id(const char *ln, size_t ln_sz,
+                                    const char **bits, size_t *dim,
+                                    size_t *id_sz)
+{
+    const char *s, *r;
+    size_t i, l, d;
+
+    s = ln;             //  bit data
+    d = 0;              //  length of bit data
+
+    if (ln_sz >= 1 && pack_code[(uint8_t) ln[0]] != 0xFF) {
+        d = 1;
+    } else if (ln[0] == 'b' || ln[0] == 'B') {
+        s++;
+        while(d < ln_sz - 1 && pack_code[(uint8_t) s[d]] != 0xFF)
+            d++;
+    } else {
+        return NULL;
+    }
+    r = s + d;          //  signal name
+    l = ln_sz - (r - ln);
+    if (ln[0] == 'b' || ln[0] == 'B') {
+        while(l > 0 && *r == ' ') {
+            r++;
+            l--;
+        }
+    }
+    for (i = 0; i < l && !isspace(r[i]); i++)
+        ;
+    *bits = s;
+    *dim = d;
+    *id_sz = i;
+
+    return r;
+}
+
+//  find the variable of a value change line and its d bits of data at
+//  *bits. returns NULL on error and sets *err.
+
+enum { CHG_FORMAT = 1, CHG_ID, CHG_DIM };
+
+static inline var_t *change_var(const vcd_hdr_t *h,
+                                const char *ln, size_t ln_sz,
+                                const char **bits, size_t *dim, int *err)
+{
+    const char *id;
+    size_t l;
+    var_t *v;
+
+    id = change_id(ln, ln_sz, bits, dim, &l);
+    if (id == NULL) {
+        *err = CHG_FORMAT;
+        return NULL;
+    }
+    v = find_id(h, id, l);
+    if (v == NULL) {
+        *err = CHG_ID;
+        return NULL;
+    }
+    if (*dim == 0 || *dim > (size_t) v->d) {
+        *err = CHG_DIM;
+        return NULL;
+    }
+
+    return v;
+}
+
+//  error message for change_var(); lines or byte offsets (sep '@')
+
+static void change_error(const vcd_hdr_t *h, const char *fn, char sep,
+                            uint64_t pos, int err,
+                            const char *ln, size_t ln_sz)
+{
+    const char *id, *bits;
+    size_t l = 0, d;
+    var_t *v;
+
+    id = change_id(ln, ln_sz, &bits, &d, &l);
+    switch (err) {
+        case CHG_FORMAT:
+            fprintf(stderr, "%s%c%lu ERROR  format: %.*s\n",
+                    fn, sep, pos, (int) ln_sz, ln);
+            break;
+        case CHG_ID:
+            fprintf(stderr, "%s%c%lu ERROR  id %.*s not found: %.*s\n",
+                    fn, sep, pos, (int) l, id, (int) ln_sz, ln);
+            break;
+        case CHG_DIM:
+            v = find_id(h, id, l);
+            fprintf(stderr, "%s%c%lu ERROR  wrong dimension (%d): %.*s\n",
+                    fn, sep, pos, v != NULL ? v->d : 0, (int) ln_sz, ln);
+            break;
+    }
+}
+
+//  hamming distance between two packed states of n bytes
+
+static inline int64_t state_dist(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    uint64_t x, y;
+
+    if (n == 1)
+        return pack_dist_word(a[0] ^ b[0]);
+    if (n <= 8) {
+        x = 0;
+        y = 0;
+        memcpy(&x, a, n);
+        memcpy(&y, b, n);
+        return pack_dist_word(x ^ y);
+    }
+    return pack_dist_wide(a, b, n);
+}
+
+//  append a data point to the toggle buffer
+
+static void add_toggle(toggle_data_point_t **buf, uint32_t *cap, uint32_t *n,
+                        int64_t hd, int64_t cyc)
+{
+    // Expand toggle buffer if needed
+    if (*n >= *cap) {
+        *cap *= 2;
+        *buf = realloc(*buf, *cap * sizeof(toggle_data_point_t));
+        if (*buf == NULL) {
+            fprintf(stderr, "Error reallocating toggle data buffer\n");
+            exit(-1);
+        }
+    }
+
+    // Store toggle data point
+    (*buf)[*n].count = (uint32_t) hd;
+    (*buf)[*n].time_step = (uint32_t) cyc;
+    (*n)++;
+}
+
+//  append the running scope row to the matrix and clear it
+
+static void mat_add(scope_mat_t *m)
+{
+    int i, k;
+
+    k = m->h->scope_n;
+    if (m->n >= m->cap) {
+        m->cap = m->cap == 0 ? 1000 : 2 * m->cap;
+        m->data = realloc(m->data, (m->cap * k + 1) * sizeof(uint32_t));
+        if (m->data == NULL)
+            exit(-1);
+    }
+    for (i = 0; i < k; i++) {
+        m->data[m->n * k + i] = (uint32_t) m->row[i];
+        m->row[i] = 0;
+    }
+    m->n++;
+}
+
+//  a jump of more than gap_step between two dumps ends a trace window (as
+//  in ToggleTrace of the simulator): the distance pending from the dump
+//  that closed it is dropped, and the first dump after the jump only
+//  updates the state, so the changes between windows are not a point
+
+static void gap_drop(int64_t *hd, scope_mat_t *mat, pm_run_t *pm)
+{
+    int k;
+
+    *hd = 0;
+    if (mat != NULL)
+        memset(mat->row, 0, (mat->h->scope_n + 1) * sizeof(int64_t));
+    for (k = 0; pm != NULL && k < pm->n; k++)
+        pm->acc[k] = 0;
+}
+
+static void mat_free(scope_mat_t *m)
+{
+    free(m->row);
+    free(m->data);
+    memset(m, 0, sizeof(scope_mat_t));
+}
+
+//  per-variable weights of the models. a weight file has "<pattern>
+//  <weight>" lines; the first fnmatch() pattern that matches the signal
+//  name gives its weight, unmatched signals weigh 1. reg counts the signals
+//  declared reg and those matching a "<pattern>" line of its file, if any:
+//  Verilator declares every signal wire (VCD) or logic (FST), so its
+//  registers have to be named.
+
+static int pm_init(pm_run_t *pm, const vcd_hdr_t *h)
+{
+    FILE *f;
+    char *buf = NULL, *pat = NULL;
+    size_t buf_max = 0;
+    name_buf_t nb = { NULL, 0 };
+    long long w;
+    bool *set;
+    size_t i;
+    int k;
+
+    for (k = 0; k < pm->n; k++) {
+        pm->acc[k] = 0;
+        if (pm->def[k].kind == PM_HW)
+            continue;
+        pm->wt[k] = calloc(h->var_n + 1, sizeof(int64_t));
+        if (pm->wt[k] == NULL)
+            exit(-1);
+
+        if (pm->def[k].kind == PM_REG) {
+            for (i = 0; i < h->var_n; i++)
+                pm->wt[k][i] = h->var[i].reg;
+            f = pm->def[k].arg != NULL ? fopen(pm->def[k].arg, "r") : NULL;
+            if (pm->def[k].arg != NULL && f == NULL) {
+                perror(pm->def[k].arg);
+                free(buf);
+                free(pat);
+                free(nb.s);
+                return 1;
+            }
+            while (f != NULL && getline(&buf, &buf_max, f) != -1) {
+                pat = realloc(pat, buf_max);
+                if (pat == NULL)
+                    exit(-1);
+                if (buf[0] == '#' || sscanf(buf, "%s", pat) != 1)
+                    continue;
+                for (i = 0; i < h->var_n; i++) {
+                    if (fnmatch(pat, get_signame(h, &h->var[i], &nb), 0) == 0)
+                        pm->wt[k][i] = 1;
+                }
+            }
+            if (f != NULL)
+                fclose(f);
+            for (i = 0; i < h->var_n && pm->wt[k][i] == 0; i++)
+                ;
+            if (i == h->var_n)
+                fprintf(stderr, "Warning: no signal is a register for the reg model"
+                                " (declared reg%s); its stream is zero\n",
+                        pm->def[k].arg != NULL ? " or in the pattern file" :
+                        ", none in Verilator waveforms: use reg=<patterns>");
+            continue;
+        }
+
+        f = fopen(pm->def[k].arg, "r");
+        if (f == NULL) {
+            perror(pm->def[k].arg);
+            free(buf);
+            free(pat);
+            free(nb.s);
+            return 1;
+        }
+        set = calloc(h->var_n + 1, sizeof(bool));
+        if (set == NULL)
+            exit(-1);
+        while (getline(&buf, &buf_max, f) != -1) {
+            pat = realloc(pat, buf_max);
+            if (pat == NULL)
+                exit(-1);
+            if (buf[0] == '#' || sscanf(buf, "%s %lld", pat, &w) != 2)
+                continue;
+            for (i = 0; i < h->var_n; i++) {
+                if (!set[i] &&
+                    fnmatch(pat, get_signame(h, &h->var[i], &nb), 0) == 0) {
+                    pm->wt[k][i] = w;
+                    set[i] = true;
+                }
+            }
+        }
+        for (i = 0; i < h->var_n; i++) {
+            if (!set[i])
+                pm->wt[k][i] = 1;
+        }
+        free(set);
+        fclose(f);
+    }
+    free(buf);
+    free(pat);
+    free(nb.s);
+
+    return 0;
+}
+
+//  account one value change; sd is the distance to the previous value,
+//  which does not exist for the first update of a variable
+
+static inline void pm_update(pm_run_t *pm, size_t vi, const var_t *v,
+                                const uint8_t *val, int64_t sd, bool first)
+{
+    int k;
+
+    for (k = 0; k < pm->n; k++) {
+        switch (pm->def[k].kind) {
+            case PM_HW:
+                pm->acc[k] += pack_weight(val, v->w);
+                break;
+            case PM_WHD:
+            case PM_REG:
+                if (!first)
+                    pm->acc[k] += pm->wt[k][vi] * sd;
+                break;
+        }
+    }
+}
+
+//  append the running values to the streams and clear them
+
+static void pm_add(pm_run_t *pm)
+{
+    int k;
+
+    if (pm->len >= pm->cap) {
+        pm->cap = pm->cap == 0 ? 1000 : 2 * pm->cap;
+        for (k = 0; k < pm->n; k++) {
+            pm->data[k] = realloc(pm->data[k], pm->cap * sizeof(uint32_t));
+            if (pm->data[k] == NULL)
+                exit(-1);
+        }
+    }
+    for (k = 0; k < pm->n; k++) {
+        pm->data[k][pm->len] = (uint32_t) pm->acc[k];
+        pm->acc[k] = 0;
+    }
+    pm->len++;
+}
+
+static void pm_free(pm_run_t *pm)
+{
+    int k;
+
+    for (k = 0; k < PM_MAX; k++) {
+        free(pm->wt[k]);
+        free(pm->data[k]);
+        pm->wt[k] = NULL;
+        pm->data[k] = NULL;
+    }
+    pm->len = 0;
+    pm->cap = 0;
+}
+
+//  parallel parsing of the value changes. the body is split at "#<time>"
+//  lines; each worker runs the serial algorithm on its chunk with a private
+//  state and records a list of cycle events. the first update of each
+//  variable in a chunk is kept aside, since its distance depends on the
+//  state left by the preceding chunks. the events are replayed in order
+//  once those distances are known.
 
-// Structure to hold toggle data point
 typedef struct {
-    uint32_t count;
-    uint32_t time_step;
-} toggle_data_point_t;
+    uint64_t hd;            //  distance accumulated before the event
+    int64_t cyc;            //  new cycle (INT64_MIN: end of chunk)
+} body_ev_t;
 
-//  hash table; contains an index to *var array
-#define ID_HASH_MAX (96 * 96 * 96)
-size_t *id_hash = NULL;
+typedef struct {
+    const vcd_hdr_t *h;     //  signal definitions
+    const char *fn;         //  file name for error messages
+    const char *map;        //  start of the mapped file
+    const char *p, *end;    //  chunk
+    const var_t *cyc_v;     //  signal with cycle counter
+    bool first;             //  first chunk (cycle counter starts at 0)
+    uint8_t *val;           //  decoded value
+    uint8_t *state;         //  private state
+    uint8_t *init;          //  first value of variables in the chunk
+    size_t *u;              //  updates in the chunk
+    size_t *touch;          //  variables in order of first update ..
+    size_t *touch_ev;       //  .. and the event that absorbs their distance
+    size_t touch_n;
+    body_ev_t *ev;          //  cycle events
+    size_t ev_n, ev_max;
+    uint64_t line;          //  lines in the chunk
+} body_chunk_t;
+
+static void add_event(body_chunk_t *c, uint64_t hd, int64_t cyc)
+{
+    if (c->ev_n >= c->ev_max) {
+        c->ev_max = c->ev_max > 0 ? 2 * c->ev_max : 1024;
+        c->ev = realloc(c->ev, c->ev_max * sizeof(body_ev_t));
+        if (c->ev == NULL)
+            exit(-1);
+    }
+    c->ev[c->ev_n].hd = hd;
+    c->ev[c->ev_n].cyc = cyc;
+    c->ev_n++;
+}
 
-static int id_hash3(const char *id)
+static void *body_worker(void *arg)
 {
-    int a, b, c;
+    body_chunk_t *c = (body_chunk_t *) arg;
+    const char *ln, *q, *bits;
+    size_t ln_sz, vi, d;
+    uint64_t hd = 0;
+    int64_t ncyc = 0, top = 0;
+    bool known = c->first;      //  ncyc is valid
+    bool have_top = false;      //  an event was recorded
+    int err;
+    var_t *v;
+
+    for (ln = c->p; ln < c->end; ln = q + 1) {
+        q = memchr(ln, '\n', c->end - ln);
+        if (q == NULL)
+            q = c->end;
+        ln_sz = q - ln;
+
+        c->line++;
+        if (ln_sz == 0)
+            continue;
 
-    a = id[0];
-    if (a < 0x20 || a > 0x7F) {
-        a = 0;
-        b = 0;
-        c = 0;
-    } else {
-        a -= 0x20;
-        b = id[1];
-        if (b < 0x20 || b > 0x7F) {
-            b = 0;
-            c = 0;
+        if (ln[0] == '#') {
+            if (c->cyc_v == NULL) {
+                ncyc = dec_to_int(&ln[1], ln_sz - 1);
+                known = true;
+            }
         } else {
-            b -= 0x20;
-            c = id[2];
-            if (c < 0x20 || c > 0x7F) {
-                c = 0;
+            v = change_var(c->h, ln, ln_sz, &bits, &d, &err);
+            if (v == NULL) {
+                change_error(c->h, c->fn, '@', ln - c->map, err, ln, ln_sz);
+                continue;
+            }
+            if (!v->on && v != c->cyc_v)
+                continue;
+            pack_bits(c->val, bits, d, v->d);
+            vi = v - c->h->var;
+            if (c->u[vi] > 0) {
+                hd += state_dist(c->state + v->s, c->val, v->w);
             } else {
-                c -= 0x20;
+                memcpy(c->init + v->s, c->val, v->w);
+                c->touch[c->touch_n] = vi;
+                c->touch_ev[c->touch_n] = c->ev_n;
+                c->touch_n++;
+            }
+            memcpy(c->state + v->s, c->val, v->w);
+            c->u[vi]++;
+
+            if (v == c->cyc_v) {
+                ncyc = pack_to_int(c->val, v->d);
+                known = true;
             }
         }
+
+        //  cycles that cannot be new in the serial order are not recorded
+        if (known && (!have_top || ncyc > top)) {
+            add_event(c, hd, ncyc);
+            hd = 0;
+            top = ncyc;
+            have_top = true;
+        }
     }
+    add_event(c, hd, INT64_MIN);
 
-    return (96 * a + b) * 96 + c;
+    return NULL;
 }
 
-//  comparator signal names via offs table
-int offs_cmp(const void *pa, const void *pb)
+//  header cache
+
+static void hdr_free(vcd_hdr_t *h)
 {
-    return strcmp( &signame[*((size_t *) pa)], &signame[*((size_t *) pb)] );
+    int i;
+
+    for (i = 0; i < h->scope_n; i++)
+        free(h->scope[i]);
+    free(h->scope);
+    free(h->pool);
+    free(h->node);
+    free(h->node_tab);
+    free(h->decl);
+    free(h->ord);
+    free(h->var);
+    free(h->id_tab);
+    free(h);
 }
 
-size_t *offs = NULL;    //  sorted offsets in signal names
-size_t offs_n = 0;
-size_t offs_max = 0;
+static void hdr_cache_free()
+{
+    vcd_hdr_t *h;
 
-//  signal states
-var_t *var = NULL;
-size_t var_n = 0;
+    while (hdr_cache != NULL) {
+        h = hdr_cache;
+        hdr_cache = h->next;
+        hdr_free(h);
+    }
+}
 
-int max_dim = 0;        //  largest signal width
-size_t st_sz = 0;       //  total number of state bits
+//  number the scopes; a variable belongs to the scope of its first name
 
-static var_t *find_id(const char *id)
+static void build_scope_index(vcd_hdr_t *h)
 {
-    int x;
+    name_buf_t nb = { NULL, 0 };
+    uint32_t *tab, sc;
     size_t i;
 
-    i = id_hash[id_hash3(id)];
+    tab = calloc(h->node_n, sizeof(uint32_t));
+    h->scope = malloc(h->node_n * sizeof(char *));
+    if (tab == NULL || h->scope == NULL)
+        exit(-1);
+    h->scope_n = 0;
+
+    for (i = 0; i < h->var_n; i++) {
+        sc = h->decl[h->ord[h->var[i].o]].sc;
+        if (tab[sc] == 0) {
+            h->scope[h->scope_n] = strdup(scope_name(h, sc, NULL, &nb));
+            if (h->scope[h->scope_n] == NULL)
+                exit(-1);
+            tab[sc] = ++h->scope_n;
+        }
+        h->var[i].sc = tab[sc] - 1;
+    }
+    free(tab);
+    free(nb.s);
+}
+
+//  scope filters: a signal is counted if one of its names matches an
+//  include pattern (or there are none) and no exclude pattern
 
-    while (i < ID_HASH_MAX) {
-        x = strcmp(var[i].id, id);
-        if (x == 0)
-            return &var[i];
-        if (x > 0)
-            return NULL;
-        i++;
+static bool var_selected(const vcd_hdr_t *h, const var_t *v, name_buf_t *nb)
+{
+    const char *s;
+    int i, k;
+
+    for (k = 0; k < v->n; k++) {
+        s = name_at(h, v->o + k, nb);
+        for (i = 0; i < flt_exc_n; i++) {
+            if (fnmatch(flt_exc[i], s, 0) == 0)
+                break;
+        }
+        if (i < flt_exc_n)
+            continue;
+        if (flt_inc_n == 0)
+            return true;
+        for (i = 0; i < flt_inc_n; i++) {
+            if (fnmatch(flt_inc[i], s, 0) == 0)
+                return true;
+        }
     }
-    return NULL;
+
+    return false;
+}
+
+//  declaration order: identifier, width, then full name. names are only
+//  assembled for aliases, which share an identifier.
+
+static __thread const vcd_hdr_t *sort_hdr = NULL;
+static __thread name_buf_t sort_nb[2];
+
+int decl_cmp(const void *pa, const void *pb)
+{
+    const decl_t *a = &sort_hdr->decl[*((size_t *) pa)];
+    const decl_t *b = &sort_hdr->decl[*((size_t *) pb)];
+    int c;
+
+    c = strcmp(sort_hdr->pool + a->id, sort_hdr->pool + b->id);
+    if (c != 0)
+        return c;
+    if (a->d != b->d)
+        return a->d < b->d ? -1 : 1;
+    return strcmp(scope_name(sort_hdr, a->sc, sort_hdr->pool + a->nam, &sort_nb[0]),
+                  scope_name(sort_hdr, b->sc, sort_hdr->pool + b->nam, &sort_nb[1]));
 }
 
-//  read a binary number
+//  sort the declarations and build var[] and the identifier index
 
-int64_t bin_to_int(const char *s, int d)
+static void hdr_build(vcd_hdr_t *h)
 {
-    int64_t i, x;
+    name_buf_t nb = { NULL, 0 };
+    const decl_t *e;
+    const char *id;
+    size_t i;
+    var_t *var;
 
-    x = 0;
-    for (i = 0; i < d; i++) {
-        if (s[i] != '0' && s[i] != '1')
-            return -1;
-        x = (2 * x) + (s[i] - '0');
+    //  sort it
+    h->ord = malloc((h->decl_n + 1) * sizeof(size_t));
+    if (h->ord == NULL)
+        exit(-1);
+    for (i = 0; i < h->decl_n; i++)
+        h->ord[i] = i;
+    sort_hdr = h;
+    qsort(h->ord, h->decl_n, sizeof(size_t), decl_cmp);
+    for (i = 0; i < 2; i++) {
+        free(sort_nb[i].s);
+        sort_nb[i].s = NULL;
+        sort_nb[i].max = 0;
     }
 
-    return x;
+    h->st_sz = 0;
+    h->max_dim = 0;
+
+    h->var_n = 0;
+    h->var = var = calloc(h->decl_n, sizeof(var_t));
+    if (var == NULL && h->decl_n > 0)
+        exit(-1);
+
+    for (i = 0; i < h->decl_n; i++) {
+        e = &h->decl[h->ord[i]];
+        id = h->pool + e->id;
+        if (e->d > h->max_dim)
+            h->max_dim = e->d;
+
+        if (h->var_n == 0 || strcmp(var[h->var_n-1].id, id) != 0) {
+            var[h->var_n].id = id;
+            var[h->var_n].n = 1;
+            var[h->var_n].d = e->d;
+            var[h->var_n].o = i;
+            var[h->var_n].reg = false;
+            h->var_n++;
+        } else {
+            if (var[h->var_n - 1].d != e->d) {
+                fprintf(stderr, "ERROR  Dimension mismatch: %s %d != %d\n",
+                        id, e->d, var[h->var_n - 1].d);
+            }
+            var[h->var_n - 1].n++;
+        }
+        if (e->reg)
+            var[h->var_n - 1].reg = true;
+    }
+
+    //  state only for the signals that are counted
+    for (i = 0; i < h->var_n; i++) {
+        var[i].on = var_selected(h, &var[i], &nb);
+        var[i].s = h->st_sz;
+        var[i].w = var[i].on ? PACK_BYTES(var[i].d) : 0;
+        h->st_sz += var[i].w;
+    }
+    free(nb.s);
+
+    //  identifier index
+    build_id_index(h);
+    build_scope_index(h);
 }
 
-char *get_signame(const var_t *v)
+//  same definitions: the pool, the tree and the declarations match
+
+static bool hdr_same(const vcd_hdr_t *a, const vcd_hdr_t *b)
 {
-    int i;
-    char *s;
+    size_t i;
 
-    s = &signame[offs[v->o]];
-    i = strlen(s);
-    while (i > 0 && !isspace(s[i - 1])) {
-        i--;
+    if (a->fp != b->fp || a->pool_sz != b->pool_sz ||
+        a->node_n != b->node_n || a->decl_n != b->decl_n ||
+        memcmp(a->pool, b->pool, a->pool_sz) != 0)
+        return false;
+    for (i = 0; i < a->node_n; i++) {
+        if (a->node[i].up != b->node[i].up || a->node[i].nam != b->node[i].nam)
+            return false;
     }
-    return &s[i];
+    for (i = 0; i < a->decl_n; i++) {
+        if (a->decl[i].id != b->decl[i].id || a->decl[i].nam != b->decl[i].nam ||
+            a->decl[i].sc != b->decl[i].sc || a->decl[i].d != b->decl[i].d ||
+            a->decl[i].reg != b->decl[i].reg)
+            return false;
+    }
+
+    return true;
 }
 
-int read_vcd(const char *fn, const char *timing,
-                int64_t thresh, int64_t *dump_tim, toggle_data_point_t **toggle_data, uint32_t *num_points)
+//  return a cached header with the same signal definitions as h (h is
+//  freed), or build h and add it to the cache
+
+static vcd_hdr_t *hdr_intern(vcd_hdr_t *h, bool *hit)
 {
-    FILE *fp = NULL;
-    int     fail = 0;
-    uint64_t line = 0;
-    char    buf[LINE_SZ_MAX] = "";
-    char    *tok[TOKEN_MAX];
-    size_t  len[SCOPE_MAX];
-    char    nam[LINE_SZ_MAX];
-    char    tmp[2 * ID_SZ_MAX];
+    vcd_hdr_t *c;
+    uint64_t x;
+    size_t i;
 
-    char    *state = NULL;      //  state array
-    char    *chg = NULL;        //  change line buffer
+    //  the scope table is only needed while parsing
+    free(h->node_tab);
+    h->node_tab = NULL;
 
-    //  read the actual changes
-    int64_t tim = 0;            //  current time step
-    int64_t cyc = 0, ncyc = 0;  //  cycle counter (from signals)
-    int64_t hd = 0;             //  hamming distance at time step
-    int64_t sd = 0;             //  hamming distance of signal
-    int64_t bl = 0;             //  number of bits in time step
+    x = fnv_add(0xCBF29CE484222325llu, h->pool, h->pool_sz);
+    for (i = 0; i < h->node_n; i++) {
+        x = fnv_add(x, &h->node[i].up, sizeof(uint32_t));
+    }
+    for (i = 0; i < h->decl_n; i++) {
+        x = fnv_add(x, &h->decl[i].sc, sizeof(uint32_t));
+        x = fnv_add(x, &h->decl[i].d, sizeof(int));
+        x = fnv_add(x, &h->decl[i].reg, sizeof(bool));
+    }
+    h->fp = x;
+
+    pthread_mutex_lock(&hdr_lock);
+    for (c = hdr_cache; c != NULL; c = c->next) {
+        if (hdr_same(c, h)) {
+            pthread_mutex_unlock(&hdr_lock);
+            hdr_free(h);
+            *hit = true;
+            return c;
+        }
+    }
+    hdr_build(h);
+    h->next = hdr_cache;
+    hdr_cache = h;
+    pthread_mutex_unlock(&hdr_lock);
+    *hit = false;
 
-    bool    sigd = false;       //  dump signal changes?
-    var_t   *cyc_v = NULL;      //  signal vith cycle counter
+    return h;
+}
 
-    //  toggle data collection
-    uint32_t toggle_capacity = 1000;
-    uint32_t toggle_count = 0;
-    toggle_data_point_t *toggle_buffer = malloc(toggle_capacity * sizeof(toggle_data_point_t));
-    if (toggle_buffer == NULL) {
-        fprintf(stderr, "Error allocating memory for toggle data buffer\n");
-        exit(-1);
+//  name pool: room for l more bytes
+
+static void pool_reserve(vcd_hdr_t *h, size_t l)
+{
+    if (h->pool_sz + l > h->pool_max) {
+        while (h->pool_sz + l > h->pool_max)
+            h->pool_max <<= 1;
+        h->pool = realloc(h->pool, h->pool_max);
+        if (h->pool == NULL)
+            exit(-1);
     }
+}
 
-    size_t i, j, l, n;
-    int x, y, k, d, scope;
-    bool flag;
+//  zero-terminated copy of l bytes of s; returns its offset
 
-    char *s, *r;
-    var_t *v;                   //  signal variable
+static size_t pool_add(vcd_hdr_t *h, const char *s, size_t l)
+{
+    size_t o;
 
-    //  open file
-    fp = fopen(fn, "r");
-    if (fp == NULL) {
-        perror(fn);
-        exit(-1);
+    pool_reserve(h, l + 1);
+    o = h->pool_sz;
+    memcpy(h->pool + o, s, l);
+    h->pool[o + l] = 0;
+    h->pool_sz += l + 1;
+
+    return o;
+}
+
+//  scope named s (l bytes) below node up; new nodes are added to the tree
+
+static inline size_t scope_fnv(uint32_t up, const char *s, size_t l)
+{
+    uint64_t x;
+
+    x = fnv_add(0xCBF29CE484222325llu, &up, sizeof(uint32_t));
+    x = fnv_add(x, s, l);
+    return (size_t) (x ^ (x >> 32));
+}
+
+static uint32_t scope_enter(vcd_hdr_t *h, uint32_t up, const char *s, size_t l)
+{
+    scope_node_t *n;
+    size_t i, j, k;
+
+    for (j = scope_fnv(up, s, l); (k = h->node_tab[j & (h->node_tab_n - 1)]) != 0; j++) {
+        n = &h->node[k - 1];
+        if (n->up == up && n->len == l && memcmp(h->pool + n->nam, s, l) == 0)
+            return k - 1;
     }
 
-    //  allocate buffers
-    signame_max = 0x100000;     //  initial buffer size for signal names
-    signame_sz = 0;
-    signame = malloc(signame_max);
-    if (signame == NULL)
+    if (h->node_n >= h->node_max) {
+        h->node_max <<= 1;
+        h->node = realloc(h->node, h->node_max * sizeof(scope_node_t));
+        if (h->node == NULL)
+            exit(-1);
+    }
+    n = &h->node[h->node_n];
+    n->up = up;
+    n->nam = pool_add(h, s, l);
+    n->len = l;
+    h->node_tab[j & (h->node_tab_n - 1)] = ++h->node_n;
+
+    //  keep the table at most half full
+    if (2 * h->node_n > h->node_tab_n) {
+        free(h->node_tab);
+        h->node_tab_n <<= 1;
+        h->node_tab = calloc(h->node_tab_n, sizeof(uint32_t));
+        if (h->node_tab == NULL)
+            exit(-1);
+        for (i = 1; i < h->node_n; i++) {
+            n = &h->node[i];
+            for (j = scope_fnv(n->up, h->pool + n->nam, n->len);
+                    h->node_tab[j & (h->node_tab_n - 1)] != 0; j++)
+                ;
+            h->node_tab[j & (h->node_tab_n - 1)] = i + 1;
+        }
+    }
+
+    return h->node_n - 1;
+}
+
+//  empty header with initial buffers and the root scope
+
+static vcd_hdr_t *hdr_new()
+{
+    vcd_hdr_t *h;
+
+    h = calloc(1, sizeof(vcd_hdr_t));
+    if (h == NULL)
         exit(-1);
 
-    offs_max = 0x10000;         //  initiial number of signal names
-    offs_n = 0;
-    offs = calloc(offs_max, sizeof(size_t));
-    if (offs == NULL)
+    //  allocate buffers
+    h->pool_max = 0x100000;     //  initial size of the name pool
+    h->pool = malloc(h->pool_max);
+    h->node_max = 0x400;        //  initial number of scopes
+    h->node = malloc(h->node_max * sizeof(scope_node_t));
+    h->node_tab_n = 0x800;
+    h->node_tab = calloc(h->node_tab_n, sizeof(uint32_t));
+    h->decl_max = 0x10000;      //  initial number of signal names
+    h->decl = malloc(h->decl_max * sizeof(decl_t));
+    if (h->pool == NULL || h->node == NULL || h->node_tab == NULL ||
+        h->decl == NULL)
         exit(-1);
 
+    h->node[0].up = 0;
+    h->node[0].nam = pool_add(h, "", 0);
+    h->node[0].len = 0;
+    h->node_n = 1;
+
+    return h;
+}
+
+//  add a signal "<nam><rng>" of scope sc, e.g. "data" "[7:0]". the name
+//  keeps no white space, as a VCD reference and its range are joined.
+
+static void hdr_add_var(vcd_hdr_t *h, const char *id, int d, bool reg,
+                        uint32_t sc, const char *nam, const char *rng)
+{
+    const char *s;
+    decl_t *e;
+    size_t l;
+
+    if (h->decl_n >= h->decl_max) {
+        h->decl_max <<= 1;
+        h->decl = realloc(h->decl, h->decl_max * sizeof(decl_t));
+        if (h->decl == NULL)
+            exit(-1);
+    }
+    e = &h->decl[h->decl_n++];
+    e->id = pool_add(h, id, strlen(id));
+
+    l = strlen(nam) + (rng != NULL ? strlen(rng) : 0);
+    pool_reserve(h, l + 1);
+    e->nam = h->pool_sz;
+    for (s = nam; *s != 0; s++) {
+        if (!isspace(*s))
+            h->pool[h->pool_sz++] = *s;
+    }
+    for (s = rng; s != NULL && *s != 0; s++) {
+        if (!isspace(*s))
+            h->pool[h->pool_sz++] = *s;
+    }
+    h->pool[h->pool_sz++] = 0;
+    e->sc = sc;
+    e->d = d < 0 ? 0 : d;
+    e->reg = reg;
+}
+
+//  read the preamble up to $enddefinitions
+
+static vcd_hdr_t *read_header(vcd_in_t *in, uint64_t *line, bool *hit)
+{
+    char    *buf = NULL;        //  copy of the current line
+    size_t  buf_max = 0;
+    char    *tok[TOKEN_MAX];
+    const char *ln;             //  current line
+    size_t  ln_sz;              //  length of current line
+
+    size_t i, n;
+    uint32_t sc;
+    bool flag;
+    vcd_hdr_t *h;
+
+    h = hdr_new();
+
     //  read the preamble
-    scope = 0;
-    k = 0;
-    while(fgets(buf, sizeof(buf), fp) == buf) {
-        line++;
+    sc = 0;
+    while((ln = vcd_line(in, &ln_sz)) != NULL) {
+        (*line)++;
+        if (ln_sz + 1 > buf_max) {
+            buf_max = 2 * (ln_sz + 1);
+            buf = realloc(buf, buf_max);
+            if (buf == NULL)
+                exit(-1);
+        }
+        memcpy(buf, ln, ln_sz);
+        buf[ln_sz] = 0;
         n = 0;
         flag = true;
-        for (i = 0; i < (int) sizeof(buf); i++) {
+        for (i = 0; i < ln_sz; i++) {
             if (buf[i] == 0)
                 break;
             if (isspace(buf[i])) {
@@ -207,191 +1666,496 @@ int read_vcd(const char *fn, const char *timing,
                 continue;
             }
             if (flag) {
-                tok[n++] = &buf[i];
-                if (n > TOKEN_MAX)
+                if (n >= TOKEN_MAX)
                     break;
+                tok[n++] = &buf[i];
                 flag = false;
             }
         }
-/*
-        // printf("%lu %d:", line, scope);
-        for (i = 0; i < n; i++) {
-            // printf(" <%s>", tok[i]);
-        }
-        // printf("\n");
-*/
+
         if (n >= 1 && strcmp(tok[0], "$enddefinitions") == 0)
             break;
-        if (n >= 3 && strcmp(tok[0], "$scope") == 0) {
-            if (scope > SCOPE_MAX)
-                goto wire_too_long;
-            l = strlen(tok[2]);
-            if (k + l + 1 >= LINE_SZ_MAX)
-                goto wire_too_long;
-            len[scope] = l;
-            memcpy(nam + k, tok[2], l);
-            k += l;
-            nam[k++] = '.';
-            nam[k] = 0;
-            scope++;
-            continue;
+        if (n >= 3 && strcmp(tok[0], "$scope") == 0) {
+            sc = scope_enter(h, sc, tok[2], strlen(tok[2]));
+            continue;
+        }
+        if (n >= 1 && strcmp(tok[0], "$upscope") == 0) {
+            sc = h->node[sc].up;
+            continue;
+        }
+        if (n >= 6 && strcmp(tok[0], "$var") == 0) {
+            //  "$var wire 8 # data [7:0] $end": the range is a token of
+            //  its own, joined to the name
+            hdr_add_var(h, tok[3], atoi(tok[2]), strcmp(tok[1], "reg") == 0,
+                        sc, tok[4], strcmp(tok[5], "$end") != 0 ? tok[5] : NULL);
+        }
+    }
+    free(buf);
+
+    return hdr_intern(h, hit);
+}
+
+//  true if the file name has the given extension
+
+static bool has_ext(const char *fn, const char *ext)
+{
+    size_t l, e;
+
+    l = strlen(fn);
+    e = strlen(ext);
+    return l > e && strcmp(fn + l - e, ext) == 0;
+}
+
+#ifdef READVCD_FST
+
+//  FST input. handles are turned into verilator-style identifier codes so
+//  the header, cache and direct index of the VCD path are reused; the value
+//  changes arrive in time order from the block iterator of fstapi.
+
+typedef struct {
+    const vcd_hdr_t *h;
+    var_t   **fac;              //  handle -> variable
+    uint8_t *state;             //  packed state array
+    size_t  *upd;               //  how many times each var was updated
+    uint8_t *val;               //  packed value of a change
+    char    *fix;               //  value with 9-state characters mapped
+    uint64_t nfix;              //  values that needed it
+    var_t   *cyc_v;             //  signal vith cycle counter
+    int64_t thresh;             //  toggle threshold
+    int64_t tim, cyc, ncyc, hd; //  as in read_vcd()
+    bool    first;              //  no time step seen yet
+    bool    skip;               //  before the window: no counting
+    bool    done;               //  past the window
+    bool    sync;               //  first dump after a gap: state only
+    bool    drop;               //  no point for the dump before the gap
+    uint64_t chg;               //  number of value changes
+    scope_mat_t *mat;           //  per-scope rows or NULL
+    pm_run_t *pm;               //  additional power models or NULL
+
+    toggle_data_point_t *buf;   //  toggle data
+    uint32_t cap, n;
+} fst_run_t;
+
+//  bijective base-94 identifier of handle x, inverse of id_code(). verilator
+//  numbers FST handles like its VCD codes, so both give the same identifiers.
+//  a 32-bit handle has at most 5 digits.
+
+#define FST_ID_SZ   8
+
+static void fst_id(char *id, fstHandle x)
+{
+    int i;
+
+    id[0] = '!' + x % 94;
+    x /= 94;
+    for (i = 1; x > 0 && i < FST_ID_SZ - 1; i++) {
+        x--;
+        id[i] = '!' + x % 94;
+        x /= 94;
+    }
+    id[i] = 0;
+}
+
+//  SystemVerilog writers may store 9-state values (u w h l -) that the
+//  packed state cannot hold: weak h/l are read as 1/0 and the rest as x.
+//  returns the d characters to pack.
+
+static const char *fst_value(fst_run_t *r, const char *s, int d)
+{
+    int i;
+
+    for (i = 0; i < d && pack_code[(uint8_t) s[i]] != 0xFF; i++)
+        ;
+    if (i == d)
+        return s;
+
+    r->nfix++;
+    for (i = 0; i < d; i++) {
+        if (pack_code[(uint8_t) s[i]] != 0xFF)
+            r->fix[i] = s[i];
+        else if (s[i] == 'h' || s[i] == 'H')
+            r->fix[i] = '1';
+        else if (s[i] == 'l' || s[i] == 'L')
+            r->fix[i] = '0';
+        else
+            r->fix[i] = 'x';
+    }
+    return r->fix;
+}
+
+static inline void fst_cycle(fst_run_t *r)
+{
+    if (r->ncyc > r->cyc) {
+        if (r->cyc >= win_lo && r->hd >= r->thresh && !r->drop) {
+            add_toggle(&r->buf, &r->cap, &r->n, r->hd, r->cyc);
+            if (r->mat != NULL)
+                mat_add(r->mat);
+            if (r->pm != NULL)
+                pm_add(r->pm);
+            r->hd = 0;
+        }
+        r->drop = false;
+        r->cyc = r->ncyc;
+        if (r->cyc >= win_lo)
+            r->skip = false;
+        if (r->cyc >= win_hi)
+            r->done = true;
+    }
+}
+
+static void fst_change(void *arg, uint64_t time, fstHandle fac,
+                        const unsigned char *value)
+{
+    fst_run_t *r = (fst_run_t *) arg;
+    var_t *v;
+    size_t vi;
+    int64_t sd;
+
+    //  the iterator cannot be stopped; changes past the window are dropped
+    if (r->done)
+        return;
+
+    //  equivalent of a "#<time>" line
+    if (r->first || (int64_t) time != r->tim) {
+        if (gap_step > 0) {
+            r->sync = !r->first && (int64_t) time > r->tim + gap_step;
+            r->drop = r->sync && r->cyc_v == NULL;
+            if (r->sync)
+                gap_drop(&r->hd, r->mat, r->pm);
+        }
+        r->first = false;
+        r->tim = time;
+        if (r->cyc_v == NULL)
+            r->ncyc = r->tim;
+        fst_cycle(r);
+        if (r->done)
+            return;
+    }
+
+    v = r->fac[fac];
+    if (v == NULL)
+        return;
+    vi = v - r->h->var;
+    r->chg++;
+
+    pack_bits(r->val, fst_value(r, (const char *) value, v->d), v->d, v->d);
+    sd = 0;
+    if (!r->skip && !r->sync && r->upd[vi] > 0) {
+        sd = state_dist(r->state + v->s, r->val, v->w);
+        r->hd += sd;
+        if (r->mat != NULL)
+            r->mat->row[v->sc] += sd;
+    }
+    if (r->pm != NULL && !r->skip && !r->sync)
+        pm_update(r->pm, vi, v, r->val, sd, r->upd[vi] == 0);
+    memcpy(r->state + v->s, r->val, v->w);
+    r->upd[vi]++;
+
+    if (r->cyc_v != NULL && v == r->cyc_v)
+        r->ncyc = pack_to_int(r->val, v->d);
+    fst_cycle(r);
+}
+
+static int read_fst(const char *fn, const char *timing, int64_t thresh,
+                    scope_mat_t *mat, pm_run_t *pm,
+                    toggle_data_point_t **toggle_data, uint32_t *num_points)
+{
+    void    *ctx;
+    struct fstHier *hier;
+    fst_run_t r;
+    vcd_hdr_t *h;
+    name_buf_t nb = { NULL, 0 };
+    char    id[FST_ID_SZ];
+    fstHandle fac_n;
+    bool    hdr_hit = false;
+    double  t0, t1, t2;
+    struct stat st;
+
+    size_t i;
+    int64_t x;
+    uint32_t sc;
+
+    *toggle_data = NULL;
+    *num_points = 0;
+
+    t0 = wall_time();
+    ctx = fstReaderOpen(fn);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: cannot open as FST\n", fn);
+        return 1;
+    }
+    fac_n = fstReaderGetMaxHandle(ctx);
+
+    //  hierarchy
+    h = hdr_new();
+    sc = 0;
+    fstReaderIterateHierRewind(ctx);
+    while ((hier = fstReaderIterateHier(ctx)) != NULL) {
+        switch (hier->htyp) {
+            case FST_HT_SCOPE:
+                sc = scope_enter(h, sc, hier->u.scope.name,
+                                    strlen(hier->u.scope.name));
+                break;
+
+            case FST_HT_UPSCOPE:
+                sc = h->node[sc].up;
+                break;
+
+            case FST_HT_VAR:
+                //  real and string values have no bits to toggle
+                if (hier->u.var.typ == FST_VT_VCD_REAL ||
+                    hier->u.var.typ == FST_VT_VCD_REAL_PARAMETER ||
+                    hier->u.var.typ == FST_VT_VCD_REALTIME ||
+                    hier->u.var.typ == FST_VT_SV_SHORTREAL ||
+                    hier->u.var.typ == FST_VT_GEN_STRING)
+                    break;
+
+                //  "name [7:0]" is joined as in the VCD preamble
+                fst_id(id, hier->u.var.handle);
+                hdr_add_var(h, id, hier->u.var.length,
+                            hier->u.var.typ == FST_VT_VCD_REG, sc,
+                            hier->u.var.name, NULL);
+                break;
+        }
+    }
+    h = hdr_intern(h, &hdr_hit);
+
+    //  run state
+    memset(&r, 0, sizeof(r));
+    r.h = h;
+    r.mat = mat;
+    r.pm = pm;
+    r.thresh = thresh;
+    r.cyc = -1;
+    r.first = true;
+    r.skip = win_lo > 0;
+    r.cap = 1000;
+    r.buf = malloc(r.cap * sizeof(toggle_data_point_t));
+    r.fac = calloc(fac_n + 1, sizeof(var_t *));
+    r.state = malloc(h->st_sz);
+    r.upd = calloc(h->var_n, sizeof(size_t));
+    r.val = malloc(PACK_BYTES(h->max_dim + 64));
+    r.fix = malloc(h->max_dim + 64);
+    if (r.buf == NULL || r.fac == NULL || r.state == NULL ||
+        r.upd == NULL || r.val == NULL || r.fix == NULL)
+        exit(-1);
+    if (mat != NULL) {
+        mat->h = h;
+        mat->row = calloc(h->scope_n + 1, sizeof(int64_t));
+        if (mat->row == NULL)
+            exit(-1);
+    }
+    if (pm != NULL && pm_init(pm, h) != 0) {
+        free(r.buf);
+        free(r.fac);
+        free(r.state);
+        free(r.upd);
+        free(r.val);
+        free(r.fix);
+        fstReaderClose(ctx);
+        return 1;
+    }
+
+    //  try to much the timing signal
+    for (i = 0; i < h->var_n; i++) {
+        if (strstr(get_signame(h, &h->var[i], &nb), timing) != NULL) {
+            r.cyc_v = &h->var[i];
+            break;
         }
-        if (n >= 1 && strcmp(tok[0], "$upscope") == 0) {
-            if (scope >= 1) {
-                scope--;
-                k -= len[scope] + 1;
-                if (k < 0)
-                    k = 0;
-                nam[k] = 0;
-            }
+    }
+    free(nb.s);
+
+    //  filtered signals are not even decoded by fstapi
+    fstReaderClrFacProcessMaskAll(ctx);
+    for (i = 0; i < h->var_n; i++) {
+        if (!h->var[i].on && &h->var[i] != r.cyc_v)
             continue;
+        if (h->var[i].on)
+            pack_x(r.state + h->var[i].s, h->var[i].d);
+        x = id_code(h->var[i].id, strlen(h->var[i].id));
+        if (x >= 1 && x <= (int64_t) fac_n) {
+            r.fac[x] = &h->var[i];
+            fstReaderSetFacProcessMask(ctx, x);
         }
-        if (n >= 6 && strcmp(tok[0], "$var") == 0) {
+    }
 
-            d = atoi(tok[2]);
-            if (d < 0)
-                d = 0;
-            j = k;
-            l = strlen(tok[4]);
-            if (j + l >= (int) sizeof(nam))
-                goto wire_too_long;
-            memcpy(&nam[j], tok[4], l);
-            j += l;
-            if (n >= ID_SZ_MAX - 1) {
-                l = strlen(tok[5]);
-                if (j + l >= (int) sizeof(nam))
-                    goto wire_too_long;
-                memcpy(&nam[j], tok[5], l);
-                j += l;
-            }
-            nam[j] = 0;
+    //  cycles are time steps: blocks after the window are not even read
+    if (r.cyc_v == NULL && win_hi != INT64_MAX)
+        fstReaderSetLimitTimeRange(ctx, 0, win_hi);
 
-            l = strlen(tok[3]);
-            if (signame_sz + j + l + 20 >= signame_max) {
-                signame_max <<= 1;
-                signame = realloc(signame, signame_max);
-                if (signame == NULL)
-                    exit(-1);
-            }
+    t1 = wall_time();
+    fstReaderIterBlocks(ctx, fst_change, &r, NULL);
+    t2 = wall_time();
 
-            if (offs_n + 1 >= offs_max) {
-                offs_max <<= 1;
-                offs = realloc(offs, offs_max * sizeof(size_t));
-                if (offs == NULL)
-                    exit(-1);
-            }
-            offs[offs_n++] = signame_sz;
+    //  a cut-off iteration ends short of the next time step, which would
+    //  have closed the last cycle of the window
+    if (r.cyc_v == NULL && !r.done && win_hi != INT64_MAX &&
+        fstReaderGetEndTime(ctx) > (uint64_t) win_hi) {
+        r.ncyc = win_hi;
+        fst_cycle(&r);
+    }
 
-            memcpy(&signame[signame_sz], tok[3], l);
-            signame_sz += l;
-            snprintf(tmp, sizeof(tmp), " %d ", d);
-            l = strlen(tmp);
-            memcpy(&signame[signame_sz], tmp, l);
-            signame_sz += l;
+    if (r.nfix > 0)
+        fprintf(stderr, "%s: %lu values with 9-state characters (h/l read as 1/0, u/w/- as x)\n", fn, r.nfix);
+
+    if (stat(fn, &st) != 0)
+        st.st_size = 0;
+    if (verbose) {
+        fprintf(stderr, "[info] %s: fst %s%s, %lu changes, %.1f MB in %.3f s "
+                "(header %.3f s, %.1f M changes/s)\n", fn, kernel,
+                hdr_hit ? " (cached header)" : "", r.chg,
+                1E-6 * st.st_size, t2 - t0, t1 - t0,
+                1E-6 * r.chg / (t2 - t1 > 0 ? t2 - t1 : 1E-9));
+    }
+    if (json_fn != NULL) {
+        parse_stats_t ps = { fn, "fst", "fst", 1, h->id_direct, hdr_hit,
+                                st.st_size, 0, r.chg, r.n, t0, t1, t2 };
+        stats_json(&ps);
+    }
 
-            memcpy(&signame[signame_sz], nam, j);
-            signame_sz += j;
-            signame[signame_sz++] = 0;
+    *toggle_data = r.buf;
+    *num_points = r.n;
 
-            //  shorten the name again
-            nam[k] = 0;
-        }
-    }
+    free(r.fac);
+    free(r.state);
+    free(r.upd);
+    free(r.val);
+    free(r.fix);
+    fstReaderClose(ctx);
 
-    //  sort it
-    qsort(offs, offs_n, sizeof(size_t), offs_cmp);
+    return 0;
+}
 
-    st_sz = 0;
-    max_dim = 0;
+#endif
 
-    var_n = 0;
-    var = calloc(offs_n, sizeof(var_t));
+int read_vcd(const char *fn, const char *timing, int nthr,
+                int64_t thresh, int64_t *dump_tim, scope_mat_t *mat,
+                pm_run_t *pm, toggle_data_point_t **toggle_data,
+                uint32_t *num_points)
+{
+    vcd_in_t in;
+    vcd_hdr_t *h;
+    int     fail = 0;
+    uint64_t line = 0;
 
-    for (i = 0; i < offs_n; i++) {
-        s = &signame[offs[i]];
-        for (l = 0; l < ID_SZ_MAX; l++) {
-            if (s[l] == ' ' || s[l] == 0)
-                break;
-        }
-        memcpy(tmp, s, l);
-        memset(tmp + l, 0, 8 - l);
-        d = atoi(&s[l]);
-        if (d < 0)
-            d = 0;
-        if (d > max_dim)
-            max_dim = d;
-
-        if (var_n == 0 || strcmp(var[var_n-1].id, tmp) != 0) {
-            memcpy(var[var_n].id, tmp, 8);
-            var[var_n].n = 1;
-            var[var_n].d = d;
-            st_sz += d;
-            var[var_n].o = i;
-            var[var_n].u = 0;
-            var[var_n].s = NULL;
-            var_n++;
-        } else {
-            if (var[var_n - 1].d != d) {
-                fprintf(stderr, "ERROR  Dimension mismatch: %s %d != %d\n",
-                        tmp, d, var[var_n - 1].d);
-            }
-            var[var_n - 1].n++;
-        }
-    }
+    uint8_t *state = NULL;      //  packed state array
+    uint8_t *val = NULL;        //  packed value of a change
+    size_t  *upd = NULL;        //  how many times each var was updated
+    const char *ln;             //  current line
+    size_t  ln_sz;              //  length of current line
+    uint64_t hdr_bytes = 0;     //  size of the preamble
+    bool    hdr_hit = false;    //  header came from the cache
+    double  t0, t1, t2;         //  timing
+
+    //  read the actual changes
+    int64_t tim = 0;            //  current time step
+    int64_t cyc = 0, ncyc = 0;  //  cycle counter (from signals)
+    int64_t hd = 0;             //  hamming distance at time step
+    int64_t sd = 0;             //  hamming distance of signal
+    int64_t bl = 0;             //  number of bits in time step
+    int64_t ptim = -1;          //  time of the previous dump (gap_step)
+    bool    sync = false;       //  first dump after a gap: state only
+    bool    drop = false;       //  no point for the dump before the gap
 
-    //  create a hash table
+    bool    sigd = false;       //  dump signal changes?
+    var_t   *cyc_v = NULL;      //  signal vith cycle counter
+    bool    skip = win_lo > 0;  //  before the window: no counting
+    const char **last = NULL;   //  last change line of a var while skipping
+    size_t  *last_sz = NULL;
+    const char *bits;           //  bit data of a change
+    size_t  d;
 
-    id_hash = calloc(ID_HASH_MAX, sizeof(size_t));
-    if (id_hash == NULL)
+    //  toggle data collection
+    uint32_t toggle_capacity = 1000;
+    uint32_t toggle_count = 0;
+    toggle_data_point_t *toggle_buffer = malloc(toggle_capacity * sizeof(toggle_data_point_t));
+    if (toggle_buffer == NULL) {
+        fprintf(stderr, "Error allocating memory for toggle data buffer\n");
         exit(-1);
-    y = 0;
-    j = 0;
-    for (i = 0; i < var_n; i++) {
-        x = id_hash3(var[i].id);
-        if (x > y) {
-            while (y < x) {
-                id_hash[y++] = j;
-            }
-            id_hash[x] = i;
-        }
-        y = x;
-        j = i;
     }
-    while (y < ID_HASH_MAX) {
-        id_hash[y++] = j;
+
+    size_t i, j, n, vi;
+    int x;
+
+    char *s, *r;
+    name_buf_t nb = { NULL, 0 };
+    var_t *v;                   //  signal variable
+    body_chunk_t *chunk = NULL; //  parallel parsing
+    pthread_t *thr = NULL;
+    int     nrun = 1;           //  threads that parsed the body
+
+    *toggle_data = NULL;
+    *num_points = 0;
+
+    //  FST is a block-compressed binary format with its own reader
+    if (has_ext(fn, ".fst")) {
+        free(toggle_buffer);
+#ifdef READVCD_FST
+        return read_fst(fn, timing, thresh, mat, pm, toggle_data, num_points);
+#else
+        fprintf(stderr, "%s: FST input needs readvcd built with READVCD_FST\n", fn);
+        return 1;
+#endif
+    }
+
+    //  open file
+    t0 = wall_time();
+    if (vcd_open(&in, fn) != 0) {
+        perror(fn);
+        free(toggle_buffer);
+        return 1;
     }
 
+    h = read_header(&in, &line, &hdr_hit);
+    hdr_bytes = vcd_bytes(&in);
+
     /* printf("%s preamble: %lu lines, %lu signames, %lu ids, "
             "max var %d, tot %zu bits.\n",
-            fn, line, offs_n, var_n, max_dim, st_sz); */
+            fn, line, h->decl_n, h->var_n, h->max_dim, h->st_sz); */
 
     //  initialize state array
-    state = malloc(st_sz);
-    if (state == NULL)
+    state = malloc(h->st_sz);
+    upd = calloc(h->var_n, sizeof(size_t));
+    if (state == NULL || upd == NULL)
         exit(-1);
-    memset(state, 'x', st_sz);
 
-    s = state;
-    for (i = 0; i < var_n; i++) {
-        var[i].s = s;
-        s += var[i].d;
+    for (i = 0; i < h->var_n; i++) {
+        if (h->var[i].on)
+            pack_x(state + h->var[i].s, h->var[i].d);
+    }
+
+    //  per-scope running distances
+    if (mat != NULL) {
+        mat->h = h;
+        mat->row = calloc(h->scope_n + 1, sizeof(int64_t));
+        if (mat->row == NULL)
+            exit(-1);
+    }
+
+    //  additional power models
+    if (pm != NULL && pm_init(pm, h) != 0) {
+        free(state);
+        free(upd);
+        free(toggle_buffer);
+        vcd_close(&in);
+        return 1;
     }
 
-    //  change line buffer
-    max_dim += 64;
-    chg = malloc(max_dim);
-    if (chg == NULL)
+    //  packed change value
+    val = malloc(PACK_BYTES(h->max_dim + 64));
+    if (val == NULL)
         exit(-1);
 
     //  try to much the timing signal
-    for (i = 0; i < var_n; i++) {
-        s = get_signame(&var[i]);
+    for (i = 0; i < h->var_n; i++) {
+        s = get_signame(h, &h->var[i], &nb);
         if (strstr(s, timing) != NULL) {
             // printf("[info] timing signal: %s\n", s);
-            cyc_v = &var[i];
+            cyc_v = &h->var[i];
             break;
         }
     }
+    free(nb.s);
     if (cyc_v == NULL) {
         // printf("[info] timing signal not found; using ticks: %s\n", timing);
     }
@@ -401,111 +2165,227 @@ int read_vcd(const char *fn, const char *timing,
     tim = 0;
     cyc = -1;
 
-    while (fgets(chg, max_dim, fp) == chg) {
+    t1 = wall_time();
+
+    //  split a mapped body between worker threads (not for the scope
+    //  matrix, the extra models, a window or gaps, which are only kept by
+    //  the serial loop)
+    if (nthr > 1 && in.map != NULL && mat == NULL && pm == NULL &&
+        win_lo == 0 && win_hi == INT64_MAX && gap_step == 0) {
+        n = nthr;
+        nrun = nthr;
+        chunk = calloc(n, sizeof(body_chunk_t));
+        thr = calloc(n, sizeof(pthread_t));
+        if (chunk == NULL || thr == NULL)
+            exit(-1);
+
+        s = (char *) in.map + in.pos;
+        for (i = 0; i < n; i++) {
+            chunk[i].h = h;
+            chunk[i].fn = fn;
+            chunk[i].map = in.map;
+            chunk[i].cyc_v = cyc_v;
+            chunk[i].first = (i == 0);
+            chunk[i].p = i == 0 ? s : chunk[i - 1].end;
+            chunk[i].end = in.map + in.map_sz;
+            if (i + 1 < n) {
+                //  next "#<time>" line after the even split point
+                r = s + (in.map + in.map_sz - s) * (i + 1) / n;
+                if (r < chunk[i].p)
+                    r = (char *) chunk[i].p;
+                while (r < chunk[i].end &&
+                        (r = memchr(r, '\n', chunk[i].end - r)) != NULL &&
+                        r + 1 < chunk[i].end && r[1] != '#')
+                    r++;
+                if (r != NULL && r < chunk[i].end)
+                    chunk[i].end = r + 1;
+            }
+
+            chunk[i].val = malloc(PACK_BYTES(h->max_dim + 64));
+            chunk[i].state = malloc(h->st_sz);
+            chunk[i].init = malloc(h->st_sz);
+            chunk[i].u = calloc(h->var_n, sizeof(size_t));
+            chunk[i].touch = calloc(h->var_n, sizeof(size_t));
+            chunk[i].touch_ev = calloc(h->var_n, sizeof(size_t));
+            if (chunk[i].val == NULL ||
+                chunk[i].state == NULL || chunk[i].init == NULL ||
+                chunk[i].u == NULL || chunk[i].touch == NULL ||
+                chunk[i].touch_ev == NULL)
+                exit(-1);
+            if (pthread_create(&thr[i], NULL, body_worker, &chunk[i]) != 0) {
+                fprintf(stderr, "%s: cannot create worker thread\n", fn);
+                exit(-1);
+            }
+        }
+
+        //  reconcile chunk boundaries and replay the cycle events in order
+        for (i = 0; i < n; i++) {
+            pthread_join(thr[i], NULL);
+            line += chunk[i].line;
+
+            for (j = 0; j < chunk[i].touch_n; j++) {
+                vi = chunk[i].touch[j];
+                v = &h->var[vi];
+                if (upd[vi] > 0) {
+                    chunk[i].ev[chunk[i].touch_ev[j]].hd +=
+                        state_dist(state + v->s, chunk[i].init + v->s, v->w);
+                }
+                memcpy(state + v->s, chunk[i].state + v->s, v->w);
+                upd[vi] += chunk[i].u[vi];
+            }
+
+            for (j = 0; j < chunk[i].ev_n; j++) {
+                hd += chunk[i].ev[j].hd;
+                ncyc = chunk[i].ev[j].cyc;
+                if (ncyc > cyc) {
+                    if (cyc >= 0 && hd >= thresh) {
+                        add_toggle(&toggle_buffer, &toggle_capacity, &toggle_count, hd, cyc);
+                        hd = 0;
+                    }
+                    cyc = ncyc;
+                }
+            }
+
+            free(chunk[i].val);
+            free(chunk[i].state);
+            free(chunk[i].init);
+            free(chunk[i].u);
+            free(chunk[i].touch);
+            free(chunk[i].touch_ev);
+            free(chunk[i].ev);
+        }
+        free(chunk);
+        free(thr);
+        in.pos = in.map_sz;
+        goto body_done;
+    }
+
+    //  lines of a mapped file stay put, so a skipped change is only
+    //  located; the last one of each variable is decoded when the window
+    //  opens. streamed lines are decoded as they come.
+    if (skip && in.map != NULL) {
+        last = calloc(h->var_n, sizeof(const char *));
+        last_sz = malloc(h->var_n * sizeof(size_t));
+        if (last == NULL || last_sz == NULL)
+            exit(-1);
+    }
+
+    while ((ln = vcd_line(&in, &ln_sz)) != NULL) {
 
         line++;
-        if (chg[0] == 0 || chg[0] == '\n')
+        if (ln_sz == 0)
             continue;
 
         //  new time
-        if (chg[0] == '#') {
-            tim = (int64_t) atoll(&chg[1]);
+        if (ln[0] == '#') {
+            tim = dec_to_int(&ln[1], ln_sz - 1);
+            if (gap_step > 0 && tim > ptim) {
+                sync = ptim >= 0 && tim > ptim + gap_step;
+                drop = sync && cyc_v == NULL;
+                if (sync) {
+                    gap_drop(&hd, mat, pm);
+                    bl = 0;
+                }
+                ptim = tim;
+            }
             if (cyc_v == NULL) {
                 ncyc    = tim;
             }
             goto new_time;
         }
 
-        s = chg;        //  bit data
-        r = s;          //  signal name
-        d = 0;          //  length of bit data
-
-        if (chg[0] == '0' || chg[0] == '1') {
-            d = 1;
-            s = chg;
-            r = chg + 1;
-        } else if (chg[0] == 'b' || chg[0] == 'B') {
-            s++;
-            d = 0;
-            while(s[d] == '0' || s[d] == '1')
-                d++;
-            r = s + d;
-            while(*r == ' ')
-                r++;
-        } else {
-            fprintf(stderr, "%s:%lu ERROR  format: %s\n",
-                    fn, line, chg);
+        //  fast path before the window: keep the state, count nothing
+        if (skip) {
+            v = change_var(h, ln, ln_sz, &bits, &d, &x);
+            if (v == NULL) {
+                change_error(h, fn, ':', line, x, ln, ln_sz);
+                continue;
+            }
+            vi = v - h->var;
+            if (v == cyc_v) {
+                pack_bits(val, bits, d, v->d);
+                memcpy(state + v->s, val, v->w);
+                upd[vi]++;
+                ncyc    = pack_to_int(val, v->d);
+                goto new_time;
+            }
+            if (!v->on)
+                continue;
+            upd[vi]++;
+            if (last != NULL) {
+                last[vi] = ln;
+                last_sz[vi] = ln_sz;
+            } else {
+                pack_bits(state + v->s, bits, d, v->d);
+            }
             continue;
         }
 
-        for (i = 0; i < ID_SZ_MAX - 1; i++) {
-            if (isspace(r[i]))
-                break;
-        }
-        r[i] = 0;
-
-        v = find_id(r);
+        v = change_var(h, ln, ln_sz, &bits, &d, &x);
         if (v == NULL) {
-            fprintf(stderr, "%s:%lu ERROR  id %s not found: %s\n",
-                    fn, line, r, chg);
+            change_error(h, fn, ':', line, x, ln, ln_sz);
             continue;
         }
-        if (d != v->d) {
-            fprintf(stderr, "%s:%lu ERROR  wrong dimension (%d): %s\n",
-                    fn, line, v->d, chg);
+        //  filtered out: no state, not counted. a filtered time signal
+        //  has no state bytes, so it passes through at zero distance
+        if (!v->on && v != cyc_v)
             continue;
-        }
+        pack_bits(val, bits, d, v->d);
+        vi = v - h->var;
 
-        if (v->u > 0) {
-            sd = 0;
-            for (i = 0; i < (size_t) d; i++) {
-                if (v->s[i] != s[i]) {
-                    sd++;
-                }
-                v->s[i] = s[i];
-            }
+        sd = 0;
+        if (upd[vi] > 0 && !sync) {
+            sd = state_dist(state + v->s, val, v->w);
 
             if (sigd && sd >= thresh) {
-                // printf("[sigd] %8ld  %ld_%s\n", sd, cyc, get_signame(v));
+                // printf("[sigd] %8ld  %ld_%s\n", sd, cyc, get_signame(h, v, &nb));
             }
-            bl += d;
+            bl += v->d;
             hd += sd;
-        } else {
-            memcpy(v->s, s, d);
+            if (mat != NULL)
+                mat->row[v->sc] += sd;
         }
-        v->u++;
+        if (pm != NULL && !sync)
+            pm_update(pm, vi, v, val, sd, upd[vi] == 0);
+        memcpy(state + v->s, val, v->w);
+        upd[vi]++;
 
         //  a cycle counter signal?  <-- can be the cycle counter in software?
         if (cyc_v != NULL && v == cyc_v) {
-            ncyc    = bin_to_int(s, d);
+            ncyc    = pack_to_int(val, v->d);
         }
 
     new_time:
 
         if (ncyc > cyc) {
-            if (cyc >= 0 && hd >= thresh) {
+            if (cyc >= win_lo && hd >= thresh && !drop) {
                 // printf("#%8ld [togd]  %ld\n", cyc, hd);
-                
-                // Expand toggle buffer if needed
-                if (toggle_count >= toggle_capacity) {
-                    toggle_capacity *= 2;
-                    toggle_buffer = realloc(toggle_buffer, toggle_capacity * sizeof(toggle_data_point_t));
-                    if (toggle_buffer == NULL) {
-                        fprintf(stderr, "Error reallocating toggle data buffer\n");
-                        exit(-1);
-                    }
-                }
-                
-                // Store toggle data point
-                toggle_buffer[toggle_count].count = (uint32_t) hd;
-                toggle_buffer[toggle_count].time_step = (uint32_t) cyc;
-                toggle_count++;
-                
+                add_toggle(&toggle_buffer, &toggle_capacity, &toggle_count, hd, cyc);
+                if (mat != NULL)
+                    mat_add(mat);
+                if (pm != NULL)
+                    pm_add(pm);
                 hd = 0;
                 bl = 0;
             }
+            drop = false;
             cyc = ncyc;
 
+            //  past the window: the rest of the file is not read
+            if (cyc >= win_hi)
+                break;
+
+            //  window opens: bring in the skipped values
+            if (skip && cyc >= win_lo) {
+                skip = false;
+                for (i = 0; last != NULL && i < h->var_n; i++) {
+                    if (last[i] != NULL) {
+                        v = change_var(h, last[i], last_sz[i], &bits, &d, &x);
+                        pack_bits(state + v->s, bits, d, v->d);
+                    }
+                }
+            }
+
             //  is this one of the "dump cycles"
             if (dump_tim != NULL) {
                 sigd = false;
@@ -519,25 +2399,39 @@ int read_vcd(const char *fn, const char *timing,
     /* printf("%s total: %lu lines, last time %ld  cycle %ld.\n",
         fn, line, tim, cyc); */
 
+body_done:
+    t2 = wall_time();
+    if (verbose) {
+        fprintf(stderr, "[info] %s: %s x%d %s %s ids%s, %lu lines, %.1f MB in %.3f s "
+                "(header %.3f s, body %.1f MB/s)\n", fn,
+                in.map != NULL ? "mmap" : "stream",
+                nrun, kernel,
+                h->id_direct ? "direct" : "hashed",
+                hdr_hit ? " (cached header)" : "", line,
+                1E-6 * vcd_bytes(&in), t2 - t0, t1 - t0,
+                1E-6 * (vcd_bytes(&in) - hdr_bytes) / (t2 - t1 > 0 ? t2 - t1 : 1E-9));
+    }
+    if (json_fn != NULL) {
+        parse_stats_t ps = { fn, "vcd", in.map != NULL ? "mmap" : "stream",
+                                nrun,
+                                h->id_direct, hdr_hit, vcd_bytes(&in), hdr_bytes,
+                                line, toggle_count, t0, t1, t2 };
+        stats_json(&ps);
+    }
+
     // Return collected toggle data
     *toggle_data = toggle_buffer;
     *num_points = toggle_count;
     // printf("[info] Collected %u toggle data points\n", toggle_count);
 
-    free(signame);
-    free(offs);
-    free(var);
-    free(id_hash);
     free(state);
-    free(chg);
-    fclose(fp);
+    free(upd);
+    free(val);
+    free(last);
+    free(last_sz);
+    vcd_close(&in);
 
     return fail;
-
-wire_too_long:
-    fprintf(stderr, "%s:%lu  Parse error -- wire name too long.\n",
-            fn, line);
-    exit(0);
 }
 
 // save to binary function
@@ -580,31 +2474,469 @@ int save_toggle_data_binary(toggle_data_point_t *toggle_data, uint32_t num_point
     return result;
 }
 
+//  scope matrix: <output>.scopes holds the rows as uint32 counts, one per
+//  scope, and <output>.scopes.txt the scope names in column order
+
+int save_scope_matrix(const scope_mat_t *m, const char *output_file)
+{
+    char fn[PATH_MAX];
+    FILE *file;
+    int i, k;
+
+    k = m->h->scope_n;
+    snprintf(fn, sizeof(fn), "%s.scopes", output_file);
+    file = fopen(fn, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file %s for writing\n", fn);
+        return -1;
+    }
+    if (k > 0 && fwrite(m->data, k * sizeof(uint32_t), m->n, file) != m->n) {
+        fprintf(stderr, "Error writing scope matrix to %s\n", fn);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    snprintf(fn, sizeof(fn), "%s.scopes.txt", output_file);
+    file = fopen(fn, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file %s for writing\n", fn);
+        return -1;
+    }
+    for (i = 0; i < k; i++) {
+        fprintf(file, "%s\n", m->h->scope[i][0] != 0 ? m->h->scope[i] : "(top)");
+    }
+    fclose(file);
+
+    return 0;
+}
+
+//  additional models: <output>.<model>, same layout as the trace
+
+int save_models(const pm_run_t *pm, const char *output_file)
+{
+    char fn[PATH_MAX];
+    FILE *file;
+    int k;
+
+    for (k = 0; k < pm->n; k++) {
+        snprintf(fn, sizeof(fn), "%s.%s", output_file, pm->def[k].name);
+        file = fopen(fn, "wb");
+        if (file == NULL) {
+            fprintf(stderr, "Error opening file %s for writing\n", fn);
+            return -1;
+        }
+        if (fwrite(pm->data[k], sizeof(uint32_t), pm->len, file) != pm->len) {
+            fprintf(stderr, "Error writing model %s to %s\n", pm->def[k].name, fn);
+            fclose(file);
+            return -1;
+        }
+        fclose(file);
+    }
+
+    return 0;
+}
+
+//  write one converted trace: plain files, or records of the trace set
+//  <output> and of the sets <base>.scopes.trs and <base>.<model>.trs
+
+int save_trace(toggle_data_point_t *toggle_data, uint32_t num_points,
+               const scope_mat_t *m, const pm_run_t *pm,
+               const char *output_file, const trs_meta_t *meta)
+{
+    char fn[PATH_MAX];
+    FILE *file;
+    int fail = 0, i, k, l;
+
+    if (!has_ext(output_file, ".trs")) {
+        fail += save_toggle_data_binary(toggle_data, num_points, output_file);
+        if (m != NULL)
+            fail += save_scope_matrix(m, output_file);
+        if (pm != NULL)
+            fail += save_models(pm, output_file);
+        return fail;
+    }
+
+    fail += trs_append(output_file, &toggle_data[0].count,
+                       sizeof(toggle_data_point_t) / sizeof(uint32_t),
+                       num_points, trs_samples, meta);
+    l = strlen(output_file) - 4;
+    if (m != NULL) {
+        //  each record is the flattened points x scopes matrix
+        k = m->h->scope_n;
+        snprintf(fn, sizeof(fn), "%.*s.scopes.trs", l, output_file);
+        fail += trs_append(fn, m->data, 1, m->n * k, trs_samples * k, meta);
+        snprintf(fn, sizeof(fn), "%.*s.scopes.txt", l, output_file);
+        file = fopen(fn, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Error opening file %s for writing\n", fn);
+            return fail - 1;
+        }
+        for (i = 0; i < k; i++) {
+            fprintf(file, "%s\n", m->h->scope[i][0] != 0 ? m->h->scope[i] : "(top)");
+        }
+        fclose(file);
+    }
+    if (pm != NULL) {
+        for (k = 0; k < pm->n; k++) {
+            snprintf(fn, sizeof(fn), "%.*s.%s.trs", l, output_file, pm->def[k].name);
+            fail += trs_append(fn, pm->data[k], 1, pm->len, trs_samples, meta);
+        }
+    }
+
+    return fail;
+}
+
+//  parse a model list "hw,whd=<weights>,reg[=<patterns>]"; hd is the trace
+//  itself
+
+static int pm_parse(char *list)
+{
+    char *s, *a;
+
+    for (s = strtok(list, ","); s != NULL; s = strtok(NULL, ",")) {
+        a = strchr(s, '=');
+        if (a != NULL)
+            *a++ = 0;
+        if (strcmp(s, "hd") == 0)
+            continue;
+        if (pm_n >= PM_MAX)
+            return -1;
+        pm_def[pm_n].name = s;
+        pm_def[pm_n].arg = a;
+        if (strcmp(s, "hw") == 0 && a == NULL)
+            pm_def[pm_n].kind = PM_HW;
+        else if (strcmp(s, "whd") == 0 && a != NULL)
+            pm_def[pm_n].kind = PM_WHD;
+        else if (strcmp(s, "reg") == 0)
+            pm_def[pm_n].kind = PM_REG;
+        else
+            return -1;
+        pm_n++;
+    }
+
+    return 0;
+}
+
+//  window "from:to", "from:" or ":to" in cycles; to is exclusive
+
+static int win_parse(const char *arg)
+{
+    char *e;
+
+    win_lo = 0;
+    win_hi = INT64_MAX;
+    if (*arg != ':') {
+        win_lo = strtoll(arg, &e, 0);
+        arg = e;
+    }
+    if (*arg == ':' && arg[1] != 0) {
+        win_hi = strtoll(arg + 1, &e, 0);
+        arg = e;
+    } else if (*arg == ':') {
+        arg++;
+    }
+
+    return *arg != 0 || win_lo < 0 || win_hi <= win_lo ? -1 : 0;
+}
+
+//  batch mode: a list of (input, output) pairs converted by a pool of
+//  workers; files with the same preamble share one cached header
+
+typedef struct {
+    char    **in;               //  input files
+    char    **out;              //  output files
+    trs_meta_t *meta;           //  trace-set metadata
+    size_t  n;                  //  number of jobs
+    size_t  next;               //  next job to hand out
+    pthread_mutex_t lock;
+    const char *timing;         //  time signal
+    int64_t thresh;             //  toggle threshold
+    int64_t *dump_tim;          //  report cycles
+    int     fail;               //  accumulated failures
+} batch_t;
+
+static void *batch_worker(void *arg)
+{
+    batch_t *b = (batch_t *) arg;
+    toggle_data_point_t *toggle_data;
+    uint32_t num_points;
+    scope_mat_t mat;
+    pm_run_t pm;
+    size_t i;
+    int fail;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->n)
+            break;
+
+        toggle_data = NULL;
+        num_points = 0;
+        memset(&mat, 0, sizeof(mat));
+        memset(&pm, 0, sizeof(pm));
+        pm.n = pm_n;
+        pm.def = pm_def;
+        fail = read_vcd(b->in[i], b->timing, 1, b->thresh, b->dump_tim,
+                        scope_out ? &mat : NULL, pm_n > 0 ? &pm : NULL,
+                        &toggle_data, &num_points);
+        if (toggle_data != NULL && num_points > 0) {
+            fail += save_trace(toggle_data, num_points, scope_out ? &mat : NULL,
+                               pm_n > 0 ? &pm : NULL, b->out[i], &b->meta[i]);
+        }
+        free(toggle_data);
+        mat_free(&mat);
+        pm_free(&pm);
+
+        pthread_mutex_lock(&b->lock);
+        b->fail += fail;
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    return NULL;
+}
+
+static void batch_add(batch_t *b, size_t *max, const char *in, const char *out,
+                      const trs_meta_t *meta)
+{
+    if (b->n >= *max) {
+        *max = *max == 0 ? 64 : 2 * *max;
+        b->in = realloc(b->in, *max * sizeof(char *));
+        b->out = realloc(b->out, *max * sizeof(char *));
+        b->meta = realloc(b->meta, *max * sizeof(trs_meta_t));
+        if (b->in == NULL || b->out == NULL || b->meta == NULL)
+            exit(-1);
+    }
+    b->in[b->n] = strdup(in);
+    b->out[b->n] = strdup(out);
+    b->meta[b->n] = *meta;
+    if (b->in[b->n] == NULL || b->out[b->n] == NULL)
+        exit(-1);
+    b->n++;
+}
+
+//  "input output [class [index [seed]]]", one per line; missing metadata
+//  comes from the command line
+
+static int batch_list(batch_t *b, size_t *max, const char *fn)
+{
+    FILE *f;
+    char *buf = NULL, *in = NULL, *out = NULL;
+    size_t buf_max = 0;
+    unsigned long long seed;
+    trs_meta_t meta;
+
+    f = strcmp(fn, "-") == 0 ? stdin : fopen(fn, "r");
+    if (f == NULL) {
+        perror(fn);
+        return 1;
+    }
+    while (getline(&buf, &buf_max, f) != -1) {
+        in = realloc(in, buf_max);
+        out = realloc(out, buf_max);
+        if (in == NULL || out == NULL)
+            exit(-1);
+        if (buf[0] == '#')
+            continue;
+        meta = trs_meta;
+        seed = meta.seed;
+        if (sscanf(buf, "%s %s %u %u %llu", in, out,
+                   &meta.label, &meta.index, &seed) >= 2) {
+            meta.seed = seed;
+            batch_add(b, max, in, out, &meta);
+        }
+    }
+    if (f != stdin)
+        fclose(f);
+    free(buf);
+    free(in);
+    free(out);
+
+    return 0;
+}
+
+//  every match of pattern, written to outdir/<name>.bin
+
+static int batch_glob(batch_t *b, size_t *max, const char *pat, const char *dir)
+{
+    glob_t g;
+    char out[PATH_MAX];
+    const char *s;
+    size_t i, l;
+
+    if (glob(pat, 0, NULL, &g) != 0) {
+        fprintf(stderr, "%s: no matching files\n", pat);
+        return 1;
+    }
+    for (i = 0; i < g.gl_pathc; i++) {
+        s = strrchr(g.gl_pathv[i], '/');
+        s = s == NULL ? g.gl_pathv[i] : s + 1;
+        l = strlen(s);
+        if (has_ext(s, ".vcd") || has_ext(s, ".fst"))
+            l -= 4;
+        snprintf(out, sizeof(out), "%s/%.*s.bin", dir, (int) l, s);
+        batch_add(b, max, g.gl_pathv[i], out, &trs_meta);
+    }
+    globfree(&g);
+
+    return 0;
+}
+
 //  main
 
 int main(int argc, char **argv)
 {
     int fail = 0;
-    int i, j;
+    int i, j, a;
     int64_t *dump_tim = NULL;
     int64_t thresh = 1;
-
-    if (argc < 4) {
-        fprintf(stderr, "Usage: readvcd <file.vcd> <time signal> <output_binary>"
-                        " [threshold] [report cycles]\n");
+    const char *simd = NULL;
+    const char *list = NULL, *pat = NULL, *outdir = ".";
+    batch_t batch;
+    size_t batch_max = 0;
+    pthread_t *thr;
+
+    while ((i = getopt(argc, argv, "vsj:k:l:g:o:mp:c:i:S:n:w:G:J:I:X:")) != -1) {
+        switch (i) {
+            case 'v':
+                verbose = true;
+                break;
+            case 's':
+                no_mmap = true;
+                break;
+            case 'j':
+                body_thr = atoi(optarg);
+                if (body_thr < 1)
+                    body_thr = (int) sysconf(_SC_NPROCESSORS_ONLN);
+                if (body_thr < 1)
+                    body_thr = 1;
+                break;
+            case 'k':
+                simd = optarg;
+                break;
+            case 'l':
+                list = optarg;
+                break;
+            case 'g':
+                pat = optarg;
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            case 'm':
+                scope_out = true;
+                break;
+            case 'p':
+                if (pm_parse(optarg) != 0) {
+                    fprintf(stderr, "readvcd: bad model list: %s\n", optarg);
+                    fail = 1;
+                    argc = 0;
+                }
+                break;
+            case 'c':
+                trs_meta.label = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                trs_meta.index = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                trs_meta.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'n':
+                trs_samples = strtoul(optarg, NULL, 0);
+                break;
+            case 'J':
+                json_fn = optarg;
+                break;
+            case 'I':
+            case 'X':
+                if ((i == 'I' ? flt_inc_n : flt_exc_n) >= FILTER_MAX) {
+                    fprintf(stderr, "readvcd: too many filters\n");
+                    fail = 1;
+                    argc = 0;
+                } else if (i == 'I') {
+                    flt_inc[flt_inc_n++] = optarg;
+                } else {
+                    flt_exc[flt_exc_n++] = optarg;
+                }
+                break;
+            case 'G':
+                gap_step = strtoll(optarg, NULL, 0);
+                break;
+            case 'w':
+                if (win_parse(optarg) != 0) {
+                    fprintf(stderr, "readvcd: bad window: %s\n", optarg);
+                    fail = 1;
+                    argc = 0;
+                }
+                break;
+            default:
+                fail = 1;
+                argc = 0;
+                break;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    //  batch mode has no input / output positionals
+    a = (list != NULL || pat != NULL) ? 1 : 3;
+
+    //  a bad option fails; missing positionals only print the usage
+    if (argc < a + 1) {
+        fprintf(stderr, "Usage: readvcd [-v] [-J file] [-s] [-m] [-p models] [-j threads] [-k kernel] [-w from:to] [-G step]"
+                        " [-I glob] [-X glob]"
+                        " [-c class] [-i index] [-S seed] [-n samples] <file.vcd>"
+                        " <time signal> <output_binary> [threshold] [report cycles]\n"
+                        "       readvcd [options] -l <list> | -g '<glob>' [-o <outdir>]"
+                        " <time signal> [threshold] [report cycles]\n"
+                        "  -v  report parse statistics (MB/s) on stderr\n"
+                        "  -J  append the statistics of each file to a file as a\n"
+                        "      line of JSON\n"
+                        "  -s  stream the input instead of mapping it\n"
+                        "  -j  parse the value changes with n threads (0: all cores);\n"
+                        "      in batch mode, convert n files at a time\n"
+                        "  -k  limit the distance kernel to scalar, sse2 or avx2\n"
+                        "  -l  convert the \"input output [class [index [seed]]]\" lines\n"
+                        "      listed in a file\n"
+                        "  -g  convert every file matching a glob pattern\n"
+                        "  -o  output directory for -g (default .)\n"
+                        "  -m  also write the per-scope distance of each point to\n"
+                        "      <output>.scopes (names in <output>.scopes.txt)\n"
+                        "  -p  additional power models, comma separated, each written\n"
+                        "      to <output>.<model>: hw (hamming weight), reg[=<file>]\n"
+                        "      (distance of signals declared reg or matching a pattern\n"
+                        "      of the file), whd=<file> (weighted distance)\n"
+                        "  -c, -i, -S  class, index and seed of the trace; an output\n"
+                        "      ending in .trs appends it with them to a trace set\n"
+                        "  -n  samples per trace of a new trace set (default: the\n"
+                        "      length of the first trace)\n"
+                        "  -w  only count cycles from <= c < to (time steps if the\n"
+                        "      time signal is not found); changes before it only\n"
+                        "      update the state, and reading stops after it\n"
+                        "  -G  dump step of a windowed waveform: a longer time jump\n"
+                        "      ends a window, dropping the point of its last dump and\n"
+                        "      counting the first dump after it as state only\n"
+                        "  -I, -X  only count signals with a full name (scope.name)\n"
+                        "      matching an include pattern and no exclude pattern;\n"
+                        "      may be repeated\n");
         return fail;
     }
-    if (argc > 4) {
-        thresh = strtoll(argv[4], NULL, 0);
+    pack_init();
+    kernel = pack_select(simd);
+    if (argc > a + 1) {
+        thresh = strtoll(argv[a + 1], NULL, 0);
     }
     // printf("[info] toggle threshold: %ld\n", thresh);
 
-    if (argc > 5) {
-        dump_tim = calloc(argc - 4, sizeof(int64_t));
+    if (argc > a + 2) {
+        dump_tim = calloc(argc - a - 1, sizeof(int64_t));
         if (dump_tim == NULL)
             exit(-1);
         j = 0;
-        for (i = 5; i < argc; i++) {
+        for (i = a + 2; i < argc; i++) {
             dump_tim[j++] = strtoll(argv[i], NULL, 0);
         }
         dump_tim[j++] = -1;
@@ -616,24 +2948,81 @@ int main(int argc, char **argv)
         // printf("\n");
     }
 
-    // Variables for toggle data collection
-    toggle_data_point_t *toggle_data = NULL;
-    uint32_t num_toggle_points = 0;
-    
-    //  read the file
-    fail += read_vcd(argv[1], argv[2], thresh, dump_tim, &toggle_data, &num_toggle_points);
+    if (a == 1) {
+        //  collect the jobs
+        memset(&batch, 0, sizeof(batch));
+        pthread_mutex_init(&batch.lock, NULL);
+        batch.timing = argv[1];
+        batch.thresh = thresh;
+        batch.dump_tim = dump_tim;
+        if (list != NULL)
+            fail += batch_list(&batch, &batch_max, list);
+        if (pat != NULL)
+            fail += batch_glob(&batch, &batch_max, pat, outdir);
+
+        //  one file per worker, each parsed serially
+        j = body_thr;
+        if ((size_t) j > batch.n)
+            j = batch.n;
+        if (j < 1)
+            j = 1;
+        thr = calloc(j, sizeof(pthread_t));
+        if (thr == NULL)
+            exit(-1);
+        for (i = 0; i < j; i++) {
+            if (pthread_create(&thr[i], NULL, batch_worker, &batch) != 0) {
+                fprintf(stderr, "cannot create worker thread\n");
+                exit(-1);
+            }
+        }
+        for (i = 0; i < j; i++) {
+            pthread_join(thr[i], NULL);
+        }
+        fail += batch.fail;
+
+        free(thr);
+        for (i = 0; (size_t) i < batch.n; i++) {
+            free(batch.in[i]);
+            free(batch.out[i]);
+        }
+        free(batch.in);
+        free(batch.out);
+        free(batch.meta);
+        pthread_mutex_destroy(&batch.lock);
 
-    // save toggle data to binary file
-    if (toggle_data != NULL && num_toggle_points > 0) {
-        fail += save_toggle_data_binary(toggle_data, num_toggle_points, argv[3]);
-        free(toggle_data);
     } else {
-        // printf("[info] No toggle data collected\n");
+
+        // Variables for toggle data collection
+        toggle_data_point_t *toggle_data = NULL;
+        uint32_t num_toggle_points = 0;
+        scope_mat_t mat;
+        pm_run_t pm;
+        memset(&mat, 0, sizeof(mat));
+        memset(&pm, 0, sizeof(pm));
+        pm.n = pm_n;
+        pm.def = pm_def;
+
+        //  read the file
+        fail += read_vcd(argv[1], argv[2], body_thr, thresh, dump_tim,
+                        scope_out ? &mat : NULL, pm_n > 0 ? &pm : NULL,
+                        &toggle_data, &num_toggle_points);
+
+        // save toggle data to binary file
+        if (toggle_data != NULL && num_toggle_points > 0) {
+            fail += save_trace(toggle_data, num_toggle_points, scope_out ? &mat : NULL,
+                               pm_n > 0 ? &pm : NULL, argv[3], &trs_meta);
+            free(toggle_data);
+        } else {
+            // printf("[info] No toggle data collected\n");
+        }
+        mat_free(&mat);
+        pm_free(&pm);
     }
 
     if (dump_tim != NULL) {
         free(dump_tim);
     }
+    hdr_cache_free();
 
     return fail;
 }
@@ -0,0 +1,164 @@
+//  trs.h
+//  === Trace-set container (.trs), written by readvcd and the simulator.
+//
+//  one file holding a whole campaign, appended to by any number of writers
+//  and mapped by the readers. little-endian.
+//
+//  header  64 bytes: magic "HWTRS001", uint32 header size, record size,
+//          samples per record, metadata size, dtype "<u4", zero padding
+//  record  uint32 class, uint32 index, uint64 seed, uint32 valid samples,
+//          3 x uint32 reserved, then the samples. the record size is fixed
+//          by the first writer; shorter traces are padded with zeros and
+//          longer ones truncated.
+//
+//  records are appended whole under an exclusive lock, in completion
+//  order; readers sort them by (class, index). the trace count follows
+//  from the file size.
+
+#ifndef _TRS_H_
+#define _TRS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define TRS_MAGIC   "HWTRS001"
+#define TRS_HDR_SZ  64
+#define TRS_META_SZ 32
+
+//  per-trace metadata of a record
+
+typedef struct {
+    uint32_t label;         //  class (0 fixed, 1 random)
+    uint32_t index;         //  trace index within the class
+    uint64_t seed;          //  stimulus seed
+} trs_meta_t;
+
+static inline void trs_put32(uint8_t *p, uint32_t x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+static inline uint32_t trs_get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline int trs_write_all(int fd, const uint8_t *p, size_t n)
+{
+    ssize_t r;
+
+    while (n > 0) {
+        r = write(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+
+    return 0;
+}
+
+//  append n samples, taken every stride words from v, as one record. a new
+//  set gets records of new_samples samples (0: n, the length of this trace).
+//  returns 0, or -1 with a message on stderr
+
+static inline int trs_append(const char *fn, const uint32_t *v, size_t stride,
+                             uint32_t n, uint32_t new_samples,
+                             const trs_meta_t *meta)
+{
+    uint8_t hdr[TRS_HDR_SZ], *rec;
+    struct stat st;
+    uint32_t samples, i;
+    size_t rec_sz;
+    off_t tail;
+    int fd;
+
+    fd = open(fn, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening file %s for writing\n", fn);
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+        perror(fn);
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        //  first writer creates the header
+        samples = new_samples > 0 ? new_samples : n;
+        memset(hdr, 0, sizeof(hdr));
+        memcpy(hdr, TRS_MAGIC, 8);
+        trs_put32(hdr + 8, TRS_HDR_SZ);
+        trs_put32(hdr + 12, TRS_META_SZ + 4 * samples);
+        trs_put32(hdr + 16, samples);
+        trs_put32(hdr + 20, TRS_META_SZ);
+        memcpy(hdr + 24, "<u4", 4);
+        if (trs_write_all(fd, hdr, sizeof(hdr)) != 0) {
+            fprintf(stderr, "Error writing header to %s\n", fn);
+            close(fd);
+            return -1;
+        }
+        st.st_size = TRS_HDR_SZ;
+    } else if (pread(fd, hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+               memcmp(hdr, TRS_MAGIC, 8) != 0 ||
+               trs_get32(hdr + 12) != TRS_META_SZ + 4 * trs_get32(hdr + 16)) {
+        fprintf(stderr, "%s: not a trace set\n", fn);
+        close(fd);
+        return -1;
+    }
+    samples = trs_get32(hdr + 16);
+    rec_sz = TRS_META_SZ + 4 * (size_t) samples;
+
+    //  drop a partial record left by a writer that died
+    tail = (st.st_size - trs_get32(hdr + 8)) % rec_sz;
+    if (tail != 0 && ftruncate(fd, st.st_size - tail) != 0) {
+        perror(fn);
+        close(fd);
+        return -1;
+    }
+
+    if (n > samples) {
+        fprintf(stderr, "%s: trace %u/%u truncated to %u samples\n",
+                fn, meta->label, meta->index, samples);
+        n = samples;
+    }
+    rec = (uint8_t *) calloc(1, rec_sz);
+    if (rec == NULL) {
+        fprintf(stderr, "%s: out of memory\n", fn);
+        close(fd);
+        return -1;
+    }
+    trs_put32(rec, meta->label);
+    trs_put32(rec + 4, meta->index);
+    trs_put32(rec + 8, meta->seed);
+    trs_put32(rec + 12, meta->seed >> 32);
+    trs_put32(rec + 16, n);
+    for (i = 0; i < n; i++) {
+        trs_put32(rec + TRS_META_SZ + 4 * i, v[i * stride]);
+    }
+    if (trs_write_all(fd, rec, rec_sz) != 0) {
+        fprintf(stderr, "Error writing record to %s\n", fn);
+        free(rec);
+        close(fd);
+        return -1;
+    }
+    free(rec);
+    close(fd);                  //  releases the lock
+
+    return 0;
+}
+
+#endif  //  _TRS_H_